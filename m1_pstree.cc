@@ -3,22 +3,63 @@
  *date: 20220813 *desc: A simplified pstree implementation."
 */
 
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <ctype.h>
-#include <fstream>
+#include <functional>
+#include <iomanip>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <sstream>
-#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 
 // for strcmp
 #include <string.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <pwd.h>
+#include <unistd.h>
+
+#include <sys/syscall.h>
+
+#include <linux/bpf.h>
+#include <linux/btf.h>
+#include <linux/cn_proc.h>
+#include <linux/connector.h>
+#include <linux/io_uring.h>
+#include <linux/netlink.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_neon.h>
+#endif
 
 namespace os {
 namespace m1 {
@@ -26,20 +67,927 @@ namespace m1 {
 using os_int = std::conditional_t<sizeof(void*) == 8, std::int64_t,
       std::int32_t>;
 
-void ReadProcs(const std::string &dir_fpath, const std::string &file_name,
-               const std::string &skip, std::vector<std::string> *files);
+void ReadProcs(int dir_fd, os_int skip, std::vector<os_int> *pids,
+               std::vector<std::uint64_t> *inodes = nullptr);
+
+// Hot path instrumentation for --stats. Building with -DPSTREE_STATS=0 turns
+// every PSTREE_COUNT() and PSTREE_PHASE() into nothing; otherwise they check
+// a flag that EnableStats() sets, and only then is a counter a relaxed atomic
+// add and a phase two steady_clock reads. A run without --stats keeps its
+// workers off the shared counters.
+#ifndef PSTREE_STATS
+#define PSTREE_STATS 1
+#endif
+
+enum class StatCounter {
+  kSyscalls,
+  kBytesRead,
+  kNodesCreated,
+  kAllocations,
+  // Tasks listed by a directory scan whose files were gone when read.
+  kVanished,
+  kNumCounters,
+};
+
+// Phases nest, BuildTree includes CreateTreeNodes, and a phase run by several
+// workers at once adds up the time of each.
+enum class StatPhase {
+  kReadProcs,
+  kCreateTreeNodes,
+  kBuildTreeNodeMap,
+  kBuildTree,
+  kSortTree,
+  // The cmdline reads of -a.
+  kFetchArgs,
+  // The PrintTree() layout, also of every --watch frame.
+  kRenderTree,
+  kNumPhases,
+};
+
+struct PstreeStats {
+  static constexpr std::size_t kNumCounters =
+      static_cast<std::size_t>(StatCounter::kNumCounters);
+  static constexpr std::size_t kNumPhases =
+      static_cast<std::size_t>(StatPhase::kNumPhases);
+
+  std::atomic<std::uint64_t> counters[kNumCounters] = {};
+  std::atomic<std::uint64_t> phase_ns[kNumPhases] = {};
+  std::atomic<std::uint64_t> phase_calls[kNumPhases] = {};
+  // Set once, before any worker starts.
+  std::atomic<bool> enabled{false};
+};
+
+PstreeStats &Stats() {
+  static PstreeStats stats;
+  return stats;
+}
+
+// Starts collecting the counters and phases, for --stats.
+void EnableStats() { Stats().enabled.store(true, std::memory_order_relaxed); }
+
+inline bool StatsEnabled() {
+  return Stats().enabled.load(std::memory_order_relaxed);
+}
+
+inline void CountStat(StatCounter counter, std::uint64_t n) {
+  if (StatsEnabled()) {
+    Stats().counters[static_cast<std::size_t>(counter)].fetch_add(
+        n, std::memory_order_relaxed);
+  }
+}
+
+// Adds the time from construction to destruction to |phase|.
+class ScopedPhase {
+ public:
+  explicit ScopedPhase(StatPhase phase)
+      : phase_(static_cast<std::size_t>(phase)), enabled_(StatsEnabled()) {
+    if (enabled_) {
+      start_ = std::chrono::steady_clock::now();
+    }
+  }
+  ~ScopedPhase() {
+    if (!enabled_) {
+      return;
+    }
+    std::chrono::nanoseconds elapsed =
+        std::chrono::steady_clock::now() - start_;
+    Stats().phase_ns[phase_].fetch_add(elapsed.count(),
+                                       std::memory_order_relaxed);
+    Stats().phase_calls[phase_].fetch_add(1, std::memory_order_relaxed);
+  }
+
+ private:
+  std::size_t phase_;
+  bool enabled_;
+  std::chrono::steady_clock::time_point start_;
+};
+
+#if PSTREE_STATS
+#define PSTREE_COUNT(counter, n) \
+  ::os::m1::CountStat(::os::m1::StatCounter::counter, (n))
+#define PSTREE_PHASE(phase) \
+  ::os::m1::ScopedPhase pstree_phase(::os::m1::StatPhase::phase)
+#else
+#define PSTREE_COUNT(counter, n) \
+  do {                           \
+  } while (0)
+#define PSTREE_PHASE(phase) \
+  do {                      \
+  } while (0)
+#endif
+
+// Reports the counters and phases since the last call on stderr, so machine
+// readable output on stdout stays intact.
+void PrintStats() {
+#if PSTREE_STATS
+  static const char *const kCounterNames[] = {
+      "syscalls", "bytes_read", "nodes_created", "allocations", "vanished"};
+  static const char *const kPhaseNames[] = {
+      "ReadProcs", "CreateTreeNodes", "BuildTreeNodeMap", "BuildTree",
+      "SortTree",  "FetchArgs",       "RenderTree"};
+  PstreeStats &stats = Stats();
+  std::cerr << "\n";
+  for (std::size_t i = 0; i < PstreeStats::kNumCounters; i++) {
+    std::cerr << kCounterNames[i] << ": "
+              << stats.counters[i].exchange(0, std::memory_order_relaxed)
+              << "\n";
+  }
+  for (std::size_t i = 0; i < PstreeStats::kNumPhases; i++) {
+    std::uint64_t ns = stats.phase_ns[i].exchange(0, std::memory_order_relaxed);
+    std::uint64_t calls =
+        stats.phase_calls[i].exchange(0, std::memory_order_relaxed);
+    std::cerr << kPhaseNames[i] << ": " << ns / 1000 << " us in " << calls
+              << " calls\n";
+  }
+#else
+  std::cerr << "\nBuilt with PSTREE_STATS=0, no stats collected.\n";
+#endif
+}
+
+// A status file is ~1.5KB on current kernels, so one page holds it whole.
+constexpr std::size_t kProcFileBufSize = 4096;
+
+// Which per-task file the attributes of a node are parsed from.
+enum class ProcFormat {
+  kStatus,  // /proc/<pid>/status, "Key:\tvalue" lines.
+  kStat,    // /proc/<pid>/stat, space separated fixed fields.
+};
+
+const char *ProcFileName(ProcFormat format) {
+  return format == ProcFormat::kStat ? "stat" : "status";
+}
+
+// Attributes of one task, with |name| pointing into the buffer it was parsed
+// from.
+struct ProcStatus {
+  std::string_view name;
+  os_int pid{-1};
+  os_int tgid{-1};
+  os_int ppid{-1};
+  os_int threads{-1};
+  // Real uid, only in the status format.
+  os_int uid{-1};
+  // Resident set in KiB, from either format.
+  os_int rss_kb{-1};
+  // utime + stime and the start time since boot in clock ticks, only in the
+  // stat format.
+  os_int cpu_ticks{-1};
+  os_int start_ticks{-1};
+  // Levels of pid namespaces the task is below that of the procfs, one less
+  // than the pids of NSpid:, only in the status format.
+  os_int ns_level{0};
+
+  bool Complete() const {
+    return !name.empty() && pid > 0 && tgid > 0 && ppid > 0 && threads > 0;
+  }
+};
+
+// Attributes parsed on top of the name, pids and thread count every tree
+// needs. The parsers are instantiated per set, so a run never decodes, nor
+// with the stat format even scans for, the fields it does not use.
+enum ProcField : unsigned {
+  kFieldUid = 1 << 0,        // Uid:, for -u.
+  kFieldResources = 1 << 1,  // Resident set and CPU times, for --resources.
+  kFieldNamespace = 1 << 2,  // NSpid:, for --group.
+  kFieldStartTime = 1 << 3,  // Start time, stat only, for --cache.
+};
+
+constexpr unsigned kNumFieldSets = 16;
+
+// Parses a per-task file of |len| bytes at |buf| into |status|. |tgid| is for
+// the stat format, which does not carry it, and |uid_filter| for status
+// parsers with kFieldUid.
+using ProcParser = void (*)(const char *buf, std::size_t len, os_int tgid,
+                            os_int uid_filter, ProcStatus *status);
+
+// Decodes the unsigned decimal at |p| into |value| and returns the position
+// right after it, or nullptr if |p| does not start with a digit.
+inline const char *DecodeInt(const char *p, const char *end, os_int *value) {
+  const char *start = p;
+  os_int v = 0;
+  while (p < end && static_cast<unsigned char>(*p - '0') < 10) {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  if (p == start) {
+    return nullptr;
+  }
+  *value = v;
+  return p;
+}
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+// Decodes the unsigned decimal at |p| like DecodeInt(), the first 8 digits
+// in one go: the digits are found with a bit trick on the 8 bytes loaded as
+// a word and combined pairwise, then into fours and into eight, by three
+// multiplications. Values over 8 digits go on byte by byte.
+inline const char *DecodeIntSwar(const char *p, const char *end,
+                                 os_int *value) {
+  if (end - p < 8) {
+    return DecodeInt(p, end, value);
+  }
+  std::uint64_t chunk;
+  memcpy(&chunk, p, sizeof(chunk));
+  std::uint64_t digits = chunk ^ 0x3030303030303030ull;
+  // A byte is a digit if it is 0-9 after the xor: adding 0x76 to it (its
+  // top bit cleared so nothing carries over) sets no top bit.
+  std::uint64_t non_digits =
+      (((digits & 0x7f7f7f7f7f7f7f7full) + 0x7676767676767676ull) | digits) &
+      0x8080808080808080ull;
+  unsigned count = (non_digits == 0 ? 8 : __builtin_ctzll(non_digits) / 8);
+  if (count == 0) {
+    return nullptr;
+  }
+  // Leading zeros in front of the digits, the first digit in the low byte.
+  digits <<= 8 * (8 - count);
+  digits = (digits * 10 + (digits >> 8)) & 0x00ff00ff00ff00ffull;
+  digits = (digits * 100 + (digits >> 16)) & 0x0000ffff0000ffffull;
+  digits = (digits * 10000 + (digits >> 32)) & 0xffffffffull;
+  if (count < 8) {
+    *value = static_cast<os_int>(digits);
+    return p + count;
+  }
+  os_int v = static_cast<os_int>(digits);
+  p += 8;
+  while (p < end && static_cast<unsigned char>(*p - '0') < 10) {
+    v = v * 10 + (*p - '0');
+    p++;
+  }
+  *value = v;
+  return p;
+}
+#else
+inline const char *DecodeIntSwar(const char *p, const char *end,
+                                 os_int *value) {
+  return DecodeInt(p, end, value);
+}
+#endif
+
+inline bool KeyIs(const char *key, std::size_t key_len, const char *expected,
+                  std::size_t expected_len) {
+  return key_len == expected_len && memcmp(key, expected, key_len) == 0;
+}
+
+// Applies the status line starting at |line| with its first ':' at |colon|
+// and ending at |eol|, with integers decoded by |Decode|. Returns true once
+// the rest of the file is not needed. Most lines are of no interest, their
+// key is told apart by its length before anything else, and the keys of the
+// fields not in |kFields| are not even compared.
+template <const char *(*Decode)(const char *, const char *, os_int *),
+          unsigned kFields>
+inline bool ParseStatusLine(const char *line, const char *colon,
+                            const char *eol, ProcStatus *status,
+                            os_int uid_filter) {
+  const std::size_t key_len = colon - line;
+  enum Key { kName, kTgid, kPid, kPPid, kVmRSS, kNSpid, kUid, kThreads } key;
+  switch (key_len) {
+    case 3:
+      if (KeyIs(line, key_len, "Pid", 3)) {
+        key = kPid;
+      } else if ((kFields & kFieldUid) && KeyIs(line, key_len, "Uid", 3)) {
+        key = kUid;
+      } else {
+        return false;
+      }
+      break;
+    case 4:
+      if (KeyIs(line, key_len, "Name", 4)) {
+        key = kName;
+      } else if (KeyIs(line, key_len, "Tgid", 4)) {
+        key = kTgid;
+      } else if (KeyIs(line, key_len, "PPid", 4)) {
+        key = kPPid;
+      } else {
+        return false;
+      }
+      break;
+    case 5:
+      if ((kFields & kFieldResources) && KeyIs(line, key_len, "VmRSS", 5)) {
+        key = kVmRSS;
+      } else if ((kFields & kFieldNamespace) &&
+                 KeyIs(line, key_len, "NSpid", 5)) {
+        key = kNSpid;
+      } else {
+        return false;
+      }
+      break;
+    case 7:
+      if (!KeyIs(line, key_len, "Threads", 7)) {
+        return false;
+      }
+      key = kThreads;
+      break;
+    default:
+      return false;
+  }
+  const char *value = colon + 1;
+  while (value < eol && isspace(static_cast<unsigned char>(*value))) {
+    value++;
+  }
+  if (value >= eol) {
+    return false;
+  }
+  switch (key) {
+    case kName:
+      status->name = std::string_view(value, eol - value);
+      break;
+    case kTgid:
+      Decode(value, eol, &status->tgid);
+      break;
+    case kPid:
+      Decode(value, eol, &status->pid);
+      break;
+    case kPPid:
+      Decode(value, eol, &status->ppid);
+      break;
+    case kVmRSS:
+      Decode(value, eol, &status->rss_kb);
+      break;
+    case kNSpid:
+      // The pid in every namespace from that of the procfs down, tab
+      // separated.
+      status->ns_level = std::count(value, eol, '\t');
+      break;
+    case kUid:
+      Decode(value, eol, &status->uid);
+      return uid_filter >= 0 && status->uid != uid_filter;
+    case kThreads:
+      Decode(value, eol, &status->threads);
+      return status->Complete();
+  }
+  return false;
+}
+
+// Scans the "Key:\tvalue" lines of a status file in place and stops as soon
+// as every attribute has been seen. With a |uid_filter| it already stops at
+// the Uid: line of a task of another user, leaving |status->threads| unset.
+// The portable kernel, a memchr() per delimiter.
+template <unsigned kFields>
+void ParseStatusScalar(const char *buf, std::size_t len, os_int,
+                       os_int uid_filter, ProcStatus *status) {
+  const char *p = buf;
+  const char *end = buf + len;
+  while (p < end) {
+    const char *eol = static_cast<const char *>(memchr(p, '\n', end - p));
+    if (eol == nullptr) {
+      eol = end;
+    }
+    const char *colon = static_cast<const char *>(memchr(p, ':', eol - p));
+    if (colon != nullptr &&
+        ParseStatusLine<DecodeInt, kFields>(p, colon, eol, status,
+                                            uid_filter)) {
+      return;
+    }
+    p = eol + 1;
+  }
+}
+
+// ParseStatusScalar() over a Kernel that classifies Kernel::kWidth bytes at
+// a time into masks of their '\n' and ':' bytes, Kernel::kShift bits per
+// byte. The set bits are walked in order, so every line costs a couple of
+// bit operations instead of two scans. Always inlined into the wrapper of
+// each kernel to be compiled for its instruction set.
+template <typename Kernel, unsigned kFields>
+__attribute__((always_inline)) inline void ParseStatusBlocks(
+    const char *buf, std::size_t len, ProcStatus *status, os_int uid_filter) {
+  const char *end = buf + len;
+  const char *line = buf;
+  const char *colon = nullptr;
+  alignas(32) char tail[Kernel::kWidth];
+  for (std::size_t base = 0; base < len; base += Kernel::kWidth) {
+    const char *block = buf + base;
+    if (len - base < Kernel::kWidth) {
+      // The last block is copied out rather than read past the end.
+      memset(tail, 0, sizeof(tail));
+      memcpy(tail, block, len - base);
+      block = tail;
+    }
+    std::uint64_t newlines;
+    std::uint64_t colons;
+    Kernel::Classify(block, &newlines, &colons);
+    std::uint64_t marks = newlines | colons;
+    while (marks != 0) {
+      unsigned bit = __builtin_ctzll(marks);
+      marks &= marks - 1;
+      const char *at = buf + base + (bit >> Kernel::kShift);
+      if ((newlines >> bit) & 1) {
+        if (colon != nullptr &&
+            ParseStatusLine<DecodeIntSwar, kFields>(line, colon, at, status,
+                                                    uid_filter)) {
+          return;
+        }
+        line = at + 1;
+        colon = nullptr;
+      } else if (colon == nullptr) {
+        colon = at;
+      }
+    }
+  }
+  if (colon != nullptr) {
+    ParseStatusLine<DecodeIntSwar, kFields>(line, colon, end, status,
+                                            uid_filter);
+  }
+}
+
+#if defined(__x86_64__)
+struct Sse2Kernel {
+  static constexpr std::size_t kWidth = 64;
+  static constexpr unsigned kShift = 0;
+  static std::uint64_t Mask(const char *p, char c) {
+    __m128i needle = _mm_set1_epi8(c);
+    std::uint64_t mask = 0;
+    for (int i = 0; i < 4; i++) {
+      __m128i bytes =
+          _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + 16 * i));
+      mask |= static_cast<std::uint64_t>(static_cast<std::uint16_t>(
+                  _mm_movemask_epi8(_mm_cmpeq_epi8(bytes, needle))))
+              << (16 * i);
+    }
+    return mask;
+  }
+  static void Classify(const char *p, std::uint64_t *newlines,
+                       std::uint64_t *colons) {
+    *newlines = Mask(p, '\n');
+    *colons = Mask(p, ':');
+  }
+};
+
+struct Avx2Kernel {
+  static constexpr std::size_t kWidth = 64;
+  static constexpr unsigned kShift = 0;
+  __attribute__((target("avx2"))) static std::uint64_t Mask(__m256i lo,
+                                                              __m256i hi,
+                                                              char c) {
+    __m256i needle = _mm256_set1_epi8(c);
+    std::uint32_t low =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(lo, needle));
+    std::uint32_t high =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(hi, needle));
+    return low | static_cast<std::uint64_t>(high) << 32;
+  }
+  __attribute__((target("avx2"))) static void Classify(
+      const char *p, std::uint64_t *newlines, std::uint64_t *colons) {
+    __m256i lo = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    __m256i hi = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + 32));
+    *newlines = Mask(lo, hi, '\n');
+    *colons = Mask(lo, hi, ':');
+  }
+};
+
+template <unsigned kFields>
+void ParseStatusSse2(const char *buf, std::size_t len, os_int,
+                     os_int uid_filter, ProcStatus *status) {
+  ParseStatusBlocks<Sse2Kernel, kFields>(buf, len, status, uid_filter);
+}
+
+template <unsigned kFields>
+__attribute__((target("avx2"))) void ParseStatusAvx2(const char *buf,
+                                                     std::size_t len, os_int,
+                                                     os_int uid_filter,
+                                                     ProcStatus *status) {
+  ParseStatusBlocks<Avx2Kernel, kFields>(buf, len, status, uid_filter);
+}
+#endif
+
+#if defined(__aarch64__)
+struct NeonKernel {
+  static constexpr std::size_t kWidth = 16;
+  // No movemask on NEON: narrowing the comparison by 4 bits leaves a nibble
+  // per byte, of which one bit is kept.
+  static constexpr unsigned kShift = 2;
+  static std::uint64_t Mask(uint8x16_t matches) {
+    uint8x8_t nibbles = vshrn_n_u16(vreinterpretq_u16_u8(matches), 4);
+    return vget_lane_u64(vreinterpret_u64_u8(nibbles), 0) &
+           0x8888888888888888ull;
+  }
+  static void Classify(const char *p, std::uint64_t *newlines,
+                       std::uint64_t *colons) {
+    uint8x16_t bytes = vld1q_u8(reinterpret_cast<const std::uint8_t *>(p));
+    *newlines = Mask(vceqq_u8(bytes, vdupq_n_u8('\n')));
+    *colons = Mask(vceqq_u8(bytes, vdupq_n_u8(':')));
+  }
+};
+
+template <unsigned kFields>
+void ParseStatusNeon(const char *buf, std::size_t len, os_int,
+                     os_int uid_filter, ProcStatus *status) {
+  ParseStatusBlocks<NeonKernel, kFields>(buf, len, status, uid_filter);
+}
+#endif
+
+// A status file parser, instantiated for every field set, and whether the
+// cpu can run it.
+struct StatusKernel {
+  const char *name;
+  ProcParser parse[kNumFieldSets];
+  bool (*supported)();
+};
+
+inline bool AlwaysSupported() { return true; }
+
+#define PSTREE_FIELD_SETS(parser)                    \
+  { parser<0>,  parser<1>,  parser<2>,  parser<3>,   \
+    parser<4>,  parser<5>,  parser<6>,  parser<7>,   \
+    parser<8>,  parser<9>,  parser<10>, parser<11>,  \
+    parser<12>, parser<13>, parser<14>, parser<15> }
+
+// Status files have no start time, the sets with kFieldStartTime reuse the
+// parsers of those without.
+#define PSTREE_STATUS_FIELD_SETS(parser)             \
+  { parser<0>, parser<1>, parser<2>, parser<3>,      \
+    parser<4>, parser<5>, parser<6>, parser<7>,      \
+    parser<0>, parser<1>, parser<2>, parser<3>,      \
+    parser<4>, parser<5>, parser<6>, parser<7> }
+
+// From slowest to fastest.
+const StatusKernel kStatusKernels[] = {
+    {"scalar", PSTREE_STATUS_FIELD_SETS(ParseStatusScalar), AlwaysSupported},
+#if defined(__x86_64__)
+    {"sse2", PSTREE_STATUS_FIELD_SETS(ParseStatusSse2), AlwaysSupported},
+    {"avx2", PSTREE_STATUS_FIELD_SETS(ParseStatusAvx2),
+     [] { return __builtin_cpu_supports("avx2") != 0; }},
+#endif
+#if defined(__aarch64__)
+    {"neon", PSTREE_STATUS_FIELD_SETS(ParseStatusNeon), AlwaysSupported},
+#endif
+};
+
+// The fastest kernel the cpu supports, picked on first use.
+const StatusKernel &BestStatusKernel() {
+  static const StatusKernel *best = [] {
+    const StatusKernel *kernel = &kStatusKernels[0];
+    for (const StatusKernel &candidate : kStatusKernels) {
+      if (candidate.supported()) {
+        kernel = &candidate;
+      }
+    }
+    return kernel;
+  }();
+  return *best;
+}
+
+// Parses "pid (comm) state ppid ..." from a stat file, up to the thread
+// count, or with kFieldResources on to the rss. The file carries no tgid, so
+// it is taken from |tgid|, which defaults to the pid itself as is the case
+// for every top level /proc/<pid> entry. There is no uid to filter on.
+template <unsigned kFields>
+void ParseStat(const char *buf, std::size_t len, os_int tgid, os_int,
+               ProcStatus *status) {
+  constexpr int kLastField = (kFields & kFieldResources)   ? 24
+                             : (kFields & kFieldStartTime) ? 22
+                                                           : 20;
+  const char *end = buf + len;
+  const char *p = DecodeInt(buf, end, &status->pid);
+  if (p == nullptr) {
+    return;
+  }
+  // comm may itself contain spaces and parentheses, only the last ')' is
+  // reliable.
+  const char *comm = static_cast<const char *>(memchr(p, '(', end - p));
+  const char *comm_end = end;
+  while (comm_end > p && *(comm_end - 1) != ')') {
+    comm_end--;
+  }
+  if (comm == nullptr || comm_end <= comm + 1) {
+    return;
+  }
+  status->name = std::string_view(comm + 1, comm_end - 1 - (comm + 1));
+  status->tgid = (tgid > 0 ? tgid : status->pid);
+  // Fields after comm start with field 3 (state); ppid is field 4, utime and
+  // stime 14 and 15, num_threads 20, starttime 22 and rss, in pages, 24.
+  static const os_int kPageKb = sysconf(_SC_PAGESIZE) / 1024;
+  os_int utime = -1;
+  os_int stime = -1;
+  p = comm_end;
+  for (int field = 3; field <= kLastField && p < end; field++) {
+    while (p < end && *p == ' ') {
+      p++;
+    }
+    if (field == 4) {
+      p = DecodeInt(p, end, &status->ppid);
+    } else if ((kFields & kFieldResources) && field == 14) {
+      p = DecodeInt(p, end, &utime);
+    } else if ((kFields & kFieldResources) && field == 15) {
+      p = DecodeInt(p, end, &stime);
+      if (p != nullptr) {
+        status->cpu_ticks = utime + stime;
+      }
+    } else if (field == 20) {
+      p = DecodeInt(p, end, &status->threads);
+      if (field == kLastField) {
+        break;
+      }
+    } else if ((kFields & (kFieldResources | kFieldStartTime)) &&
+               field == 22) {
+      p = DecodeInt(p, end, &status->start_ticks);
+    } else if (field == 24) {
+      os_int pages;
+      if (DecodeInt(p, end, &pages) != nullptr) {
+        status->rss_kb = pages * kPageKb;
+      }
+      break;
+    }
+    while (p != nullptr && p < end && *p != ' ') {
+      p++;
+    }
+    if (p == nullptr) {
+      return;
+    }
+  }
+}
+
+// The parser of |format| files for the fields of |fields|, a set of
+// ProcField.
+ProcParser SelectProcParser(ProcFormat format, unsigned fields) {
+  static const ProcParser kStatParsers[kNumFieldSets] =
+      PSTREE_FIELD_SETS(ParseStat);
+  return format == ProcFormat::kStat ? kStatParsers[fields]
+                                     : BestStatusKernel().parse[fields];
+}
+
+// Owns a file descriptor.
+class ScopedFd {
+ public:
+  explicit ScopedFd(int fd = -1) : fd_(fd) {}
+  ~ScopedFd() {
+    if (fd_ >= 0) {
+      close(fd_);
+      PSTREE_COUNT(kSyscalls, 1);
+    }
+  }
+
+  ScopedFd(const ScopedFd &) = delete;
+  ScopedFd &operator=(const ScopedFd &) = delete;
+
+  int Get() const { return fd_; }
+
+  // Closes the fd held, if any, and takes |fd|.
+  void Reset(int fd = -1) {
+    if (fd_ >= 0) {
+      close(fd_);
+      PSTREE_COUNT(kSyscalls, 1);
+    }
+    fd_ = fd;
+  }
+
+ private:
+  int fd_;
+};
+
+// Formats "<pid>/<name>" into |buf|, the path of a task file relative to the
+// directory that lists the task.
+const char *TaskPath(os_int pid, const char *name, char (&buf)[64]) {
+  char *p = buf + 24;
+  char *end = p;
+  do {
+    *--p = static_cast<char>('0' + pid % 10);
+    pid /= 10;
+  } while (pid > 0);
+  std::size_t len = end - p;
+  memmove(buf, p, len);
+  buf[len++] = '/';
+  std::size_t name_len = strlen(name);
+  assert(len + name_len < sizeof(buf));
+  memcpy(buf + len, name, name_len + 1);
+  return buf;
+}
+
+// Whether a task file failed to read with |error| because the task exited
+// after it was listed.
+bool IsVanished(int error) { return error == ENOENT || error == ESRCH; }
+
+// Reads the status (or stat) file of |pid| under |dir_fd|, a /proc or a
+// /proc/<pid>/task directory, into |buf| with a single openat/read/close and
+// parses it with |parse|. procfs hands out the whole file in one read
+// whenever it fits, only an oversized file (e.g. a status with a huge Groups:
+// line) spills into |overflow|, which then owns the bytes |status->name|
+// points to.
+bool ReadProcStatus(int dir_fd, os_int pid, ProcFormat format,
+                    ProcParser parse, os_int tgid, char *buf, std::size_t size,
+                    std::string *overflow, ProcStatus *status,
+                    os_int uid_filter = -1) {
+  char path[64];
+  int fd = openat(dir_fd, TaskPath(pid, ProcFileName(format), path),
+                  O_RDONLY | O_CLOEXEC);
+  PSTREE_COUNT(kSyscalls, 1);
+  if (fd < 0) {
+    if (IsVanished(errno)) {
+      PSTREE_COUNT(kVanished, 1);
+    }
+    return false;
+  }
+  ssize_t n;
+  do {
+    n = read(fd, buf, size);
+    PSTREE_COUNT(kSyscalls, 1);
+  } while (n < 0 && errno == EINTR);
+  const char *data = buf;
+  std::size_t len = (n > 0 ? static_cast<std::size_t>(n) : 0);
+  if (len == size) {
+    overflow->assign(buf, len);
+    char chunk[kProcFileBufSize];
+    for (;;) {
+      n = read(fd, chunk, sizeof(chunk));
+      PSTREE_COUNT(kSyscalls, 1);
+      if (n == 0) {
+        break;
+      }
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        break;
+      }
+      overflow->append(chunk, n);
+    }
+    data = overflow->data();
+    len = overflow->size();
+  }
+  int read_errno = errno;
+  close(fd);
+  PSTREE_COUNT(kSyscalls, 1);
+  PSTREE_COUNT(kBytesRead, len);
+  if (n < 0 && len == 0) {
+    // A task that exits after the open reads as ESRCH.
+    if (read_errno == ESRCH) {
+      PSTREE_COUNT(kVanished, 1);
+    }
+    errno = read_errno;
+    return false;
+  }
+  parse(data, len, tgid, uid_filter, status);
+  return true;
+}
+
+// How threads are shown. kExpand has a node per thread, read from
+// /proc/<pid>/task. kCompact draws the threads of a process as a single
+// N*[{name}] child from the Threads: count of its status, and together with
+// kHide never opens a task/ directory.
+enum class ThreadMode { kExpand, kCompact, kHide };
+
+// Order of the children of a node: by name, ties broken by pid, or by pid
+// alone with -n.
+enum class SortOrder { kName, kPid };
+
+// What the containers of --group are drawn by: their pid namespace or the
+// cgroup of their first process.
+enum class GroupMode { kNone, kPidNamespace, kCgroup };
+
+// The pid of the roots --group draws the containers under. It is negative so
+// that no pid lookup ever finds them, see PidTable::Set().
+constexpr os_int kGroupRootPid = -1;
+
+// Processes a worker reads through its io_uring per job.
+constexpr std::size_t kUringBatch = 2048;
+
+// Child slots below which SortTree() does not split the work.
+constexpr std::size_t kSortChunkSize = 16 * 1024;
+
+// Nodes live in one contiguous array per PsTree and refer to each other by
+// 32-bit index.
+using NodeIndex = std::uint32_t;
+constexpr NodeIndex kNoNode = UINT32_MAX;
+
+// Deduplicated storage of task names, which nodes refer to by 32-bit id.
+// There are a few hundred distinct names however many tasks, and a thread
+// always has the name of its process. The arguments of -a share the pool: the
+// workers of a service mostly run the same command line. Strings are stored
+// with a 16-bit length prefix in 64KiB blocks that never move, so a view of
+// one stays valid for the life of the process, and the pool is shared by
+// every PsTree of a run. Not thread safe: only the thread that owns a tree
+// creates its nodes.
+class NamePool {
+ public:
+  using Id = std::uint32_t;
+
+  // Never returned by Intern(), for a string that is not known.
+  static constexpr Id kNoId = UINT32_MAX;
+
+  // Longest name kept; status files escape and extend the 16 byte comm of
+  // workqueue kthreads, never past 64 bytes.
+  static constexpr std::size_t kMaxSize = 255;
+
+  // Longest string kept at all: a block with its length prefix.
+  static constexpr std::size_t kMaxEntrySize = (std::size_t(1) << 16) - 2;
+
+  static NamePool &Get() {
+    static NamePool *pool = new NamePool();
+    return *pool;
+  }
+
+  // Returns the id of |name|, truncated to |max_size| (at most
+  // kMaxEntrySize), adding it if new.
+  Id Intern(std::string_view name, std::size_t max_size = kMaxSize) {
+    name = name.substr(0, std::min(max_size, kMaxEntrySize));
+    if ((size_ + 1) * 2 > slots_.size()) {
+      Grow();
+    }
+    std::size_t mask = slots_.size() - 1;
+    for (std::size_t slot = std::hash<std::string_view>()(name) & mask;;
+         slot = (slot + 1) & mask) {
+      if (slots_[slot] == kNoId) {
+        slots_[slot] = Append(name);
+        size_++;
+        return slots_[slot];
+      }
+      if (View(slots_[slot]) == name) {
+        return slots_[slot];
+      }
+    }
+  }
+
+  std::string_view View(Id id) const {
+    const char *entry = blocks_[id >> kBlockBits].get() + (id & kOffsetMask);
+    std::uint16_t size;
+    memcpy(&size, entry, sizeof(size));
+    return std::string_view(entry + sizeof(size), size);
+  }
+
+ private:
+  static constexpr unsigned kBlockBits = 16;
+  static constexpr std::size_t kBlockSize = std::size_t(1) << kBlockBits;
+  static constexpr Id kOffsetMask = kBlockSize - 1;
+
+  NamePool() = default;
+
+  Id Append(std::string_view name) {
+    std::uint16_t size = static_cast<std::uint16_t>(name.size());
+    if (used_ + sizeof(size) + name.size() > kBlockSize) {
+      blocks_.emplace_back(new char[kBlockSize]);
+      used_ = 0;
+    }
+    char *entry = blocks_.back().get() + used_;
+    memcpy(entry, &size, sizeof(size));
+    memcpy(entry + sizeof(size), name.data(), name.size());
+    Id id = static_cast<Id>(((blocks_.size() - 1) << kBlockBits) | used_);
+    used_ += sizeof(size) + name.size();
+    return id;
+  }
+
+  void Grow() {
+    std::vector<Id> slots(std::max<std::size_t>(slots_.size() * 2, 1024),
+                          kNoId);
+    std::size_t mask = slots.size() - 1;
+    for (Id id : slots_) {
+      if (id == kNoId) {
+        continue;
+      }
+      std::size_t slot = std::hash<std::string_view>()(View(id)) & mask;
+      while (slots[slot] != kNoId) {
+        slot = (slot + 1) & mask;
+      }
+      slots[slot] = id;
+    }
+    slots_.swap(slots);
+  }
+
+  std::vector<std::unique_ptr<char[]>> blocks_;
+  // Bytes taken in the last block; a full one at first.
+  std::size_t used_ = kBlockSize;
+  // Open addressing table of the ids, at most half full.
+  std::vector<Id> slots_;
+  std::size_t size_ = 0;
+};
 
 struct TreeNode {
-  std::string name;
+  NamePool::Id name;
+  // With PsTree::SetArgs(): the arguments after argv[0] of a process once
+  // PsTree::FetchArgs() has read them, kNoId until then.
+  NamePool::Id args = NamePool::kNoId;
   os_int pid;
   os_int tgid;
   os_int ppid;
   bool is_thread;
   bool has_threads;
   bool is_root;
-  std::vector<TreeNode*> child_nodes;
+  // Threads of the process, itself included, as counted by the kernel; -1
+  // while unknown.
+  os_int num_threads;
+  // Real uid, -1 if the tree was not read from status files.
+  os_int uid = -1;
+  // With PsTree::SetGroupMode(): the levels of pid namespaces the task is
+  // below that of the procfs, and for a process in a deeper one than its
+  // parent the name of its group once looked up, kNoId until then.
+  os_int ns_level = 0;
+  NamePool::Id group = NamePool::kNoId;
+  // With PsTree::SetStartTimes() and the stat format: the start time since
+  // boot in clock ticks, which tells a pid that was reused apart, -1 if
+  // unknown.
+  os_int start_ticks = -1;
+  // With PsTree::SetResources(): resident set in KiB, CPU time in clock ticks
+  // and CPU usage in percent of one cpu, -1 while unknown.
+  os_int rss_kb = -1;
+  os_int cpu_ticks = -1;
+  float cpu = -1;
+  // Cleared when the task is removed from a tree that is kept up to date.
+  bool alive = true;
+  NodeIndex parent = kNoNode;
+  // The children are child_index[first_child, first_child + num_children) of
+  // the owning PsTree, stored CSR style.
+  std::uint32_t first_child = 0;
+  std::uint32_t num_children = 0;
 
-  TreeNode(const std::string &_name, os_int _pid, os_int _tgid, os_int _ppid,
+  TreeNode(NamePool::Id _name, os_int _pid, os_int _tgid, os_int _ppid,
            os_int threads) {
     name = _name;
     pid = _pid;
@@ -48,354 +996,6007 @@ struct TreeNode {
     is_thread = (tgid != pid);
     has_threads = (threads > 1);
     is_root = (pid == 1);
+    num_threads = threads;
+  }
+
+  std::string_view Name() const { return NamePool::Get().View(name); }
+
+  std::string_view Args() const {
+    return args == NamePool::kNoId ? std::string_view()
+                                   : NamePool::Get().View(args);
+  }
+
+  bool IsRoot() const { return is_root; }
+
+  bool IsThread() const { return is_thread; }
+
+  bool HasThreads() const { return has_threads; }
+
+  std::string DebugString(bool show_pids) const {
+    std::stringstream debug;
+    if (is_thread) {
+      debug << "{" << Name() << "}";
+    } else {
+      debug << Name();
+    }
+    if (show_pids) {
+      debug << "(" << pid << ")";
+    }
+    return debug.str();
+  }
+};
+
+// Resources of the processes of a subtree, see PsTree::SumResources().
+struct ResourceTotal {
+  os_int rss_kb = 0;
+  float cpu = 0;
+};
+
+// A non-owning handle on a node of a PsTree. It is two pointers and an index,
+// so pass it by value; it stays valid until the tree is modified.
+class NodeView {
+ public:
+  class ChildRange;
+
+  NodeView() = default;
+  NodeView(const TreeNode *nodes, const NodeIndex *child_index,
+           NodeIndex index)
+      : nodes_(nodes), child_index_(child_index), index_(index) {}
+
+  explicit operator bool() const {
+    return nodes_ != nullptr && index_ != kNoNode;
+  }
+  const TreeNode &operator*() const { return nodes_[index_]; }
+  const TreeNode *operator->() const { return nodes_ + index_; }
+  NodeIndex Index() const { return index_; }
+
+  inline ChildRange Children() const;
+
+ private:
+  const TreeNode *nodes_ = nullptr;
+  const NodeIndex *child_index_ = nullptr;
+  NodeIndex index_ = kNoNode;
+};
+
+class NodeView::ChildRange {
+ public:
+  class Iterator {
+   public:
+    Iterator(const TreeNode *nodes, const NodeIndex *child_index,
+             const NodeIndex *pos)
+        : nodes_(nodes), child_index_(child_index), pos_(pos) {}
+    NodeView operator*() const { return NodeView(nodes_, child_index_, *pos_); }
+    Iterator &operator++() {
+      pos_++;
+      return *this;
+    }
+    bool operator!=(const Iterator &other) const { return pos_ != other.pos_; }
+
+   private:
+    const TreeNode *nodes_;
+    const NodeIndex *child_index_;
+    const NodeIndex *pos_;
+  };
+
+  ChildRange(const TreeNode *nodes, const NodeIndex *child_index,
+             const NodeIndex *begin, std::size_t size)
+      : nodes_(nodes), child_index_(child_index), begin_(begin), size_(size) {}
+
+  Iterator begin() const { return Iterator(nodes_, child_index_, begin_); }
+  Iterator end() const { return Iterator(nodes_, child_index_, begin_ + size_); }
+  std::size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  NodeView operator[](std::size_t i) const {
+    return NodeView(nodes_, child_index_, begin_[i]);
+  }
+
+ private:
+  const TreeNode *nodes_;
+  const NodeIndex *child_index_;
+  const NodeIndex *begin_;
+  std::size_t size_;
+};
+
+NodeView::ChildRange NodeView::Children() const {
+  const TreeNode &node = nodes_[index_];
+  return ChildRange(nodes_, child_index_, child_index_ + node.first_child,
+                    node.num_children);
+}
+
+// A level of an iterative depth first walk: a node and the next of its
+// children to visit. Every walk over a tree runs on an explicit stack of these
+// instead of the call stack, so a chain of any depth is fine, and the walks of
+// a PsTree share one that keeps its capacity across snapshots. The renderer
+// keeps the layout of the level in the rest.
+struct WalkFrame {
+  NodeView node;
+  std::uint32_t next = 0;
+  std::uint32_t count = 1;
+  std::size_t depth = 0;
+  std::size_t branch_pos = 0;
+  std::size_t prefix_len = 0;
+};
+
+using WalkStack = std::vector<WalkFrame>;
+
+// Frames reserved up front, deeper chains grow the stack once.
+constexpr std::size_t kWalkStackReserve = 256;
+
+// Upper bound of /proc/sys/kernel/pid_max, PID_MAX_LIMIT on 64-bit kernels.
+constexpr os_int kPidMaxLimit = 4 * 1024 * 1024;
+
+// Reads /proc/sys/kernel/pid_max, every pid on the system is below it.
+os_int ReadPidMax() {
+  char buf[32];
+  int fd = open("/proc/sys/kernel/pid_max", O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return kPidMaxLimit;
+  }
+  ssize_t n = read(fd, buf, sizeof(buf));
+  close(fd);
+  os_int pid_max;
+  if (n <= 0 || DecodeInt(buf, buf + n, &pid_max) == nullptr || pid_max <= 0) {
+    return kPidMaxLimit;
+  }
+  return pid_max;
+}
+
+// Maps a pid to its node with a two level page table: with the default
+// pid_max of 32768 it is a handful of pages, and with a pid_max of 4M only the
+// pages that hold live pids get allocated. Lookups are two array accesses.
+class PidTable {
+ public:
+  static constexpr int kPageShift = 12;
+  static constexpr os_int kPageSize = os_int{1} << kPageShift;
+
+  PidTable() = default;
+
+  // Sizes the directory for pids below |pid_max|; larger pids still work, they
+  // just grow it.
+  void Reserve(os_int pid_max) {
+    std::size_t num_pages = static_cast<std::size_t>(
+        (pid_max + kPageSize - 1) >> kPageShift);
+    if (num_pages > pages_.size()) {
+      pages_.resize(num_pages);
+    }
+  }
+
+  void Set(os_int pid, NodeIndex index) {
+    if (pid < 0) {
+      return;
+    }
+    std::size_t page = static_cast<std::size_t>(pid >> kPageShift);
+    if (page >= pages_.size()) {
+      pages_.resize(page + 1);
+    }
+    if (pages_[page] == nullptr) {
+      pages_[page].reset(new NodeIndex[kPageSize]);
+      std::fill_n(pages_[page].get(), kPageSize, kNoNode);
+    }
+    pages_[page][pid & (kPageSize - 1)] = index;
+  }
+
+  NodeIndex Find(os_int pid) const {
+    std::size_t page = static_cast<std::size_t>(pid >> kPageShift);
+    if (pid < 0 || page >= pages_.size() || pages_[page] == nullptr) {
+      return kNoNode;
+    }
+    return pages_[page][pid & (kPageSize - 1)];
+  }
+
+  void Erase(os_int pid) {
+    std::size_t page = static_cast<std::size_t>(pid >> kPageShift);
+    if (pid >= 0 && page < pages_.size() && pages_[page] != nullptr) {
+      pages_[page][pid & (kPageSize - 1)] = kNoNode;
+    }
+  }
+
+  // Forgets every pid but keeps the pages for the next snapshot.
+  void Clear() {
+    for (std::unique_ptr<NodeIndex[]> &page : pages_) {
+      if (page != nullptr) {
+        std::fill_n(page.get(), kPageSize, kNoNode);
+      }
+    }
+  }
+
+ private:
+  std::vector<std::unique_ptr<NodeIndex[]>> pages_;
+};
+
+// A fixed set of workers running parallel-for batches. Every worker owns a
+// range of job indices and takes jobs from its front; an idle worker steals
+// the back half of the fullest-looking victim range, so uneven jobs (a process
+// with thousands of threads next to single threaded ones) still balance. The
+// calling thread takes part as worker 0, so a pool of size 1 runs inline.
+class WorkStealingPool {
+ public:
+  using Job = std::function<void(std::size_t job, std::size_t worker)>;
+
+  explicit WorkStealingPool(std::size_t num_workers)
+      : num_workers_(num_workers == 0 ? 1 : num_workers),
+        queues_(new Queue[num_workers_]) {
+    for (std::size_t worker = 1; worker < num_workers_; worker++) {
+      threads_.emplace_back(&WorkStealingPool::WorkerLoop, this, worker);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      stop_ = true;
+    }
+    start_cv_.notify_all();
+    for (std::thread &thread : threads_) {
+      thread.join();
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  std::size_t Size() const { return num_workers_; }
+
+  // Runs job(i, worker) for every i in [0, num_jobs) and returns when all of
+  // them have finished.
+  void ParallelFor(std::size_t num_jobs, const Job &job) {
+    if (num_workers_ == 1 || num_jobs <= 1) {
+      for (std::size_t i = 0; i < num_jobs; i++) {
+        job(i, 0);
+      }
+      return;
+    }
+    for (std::size_t worker = 0; worker < num_workers_; worker++) {
+      std::lock_guard<std::mutex> lock(queues_[worker].mu);
+      queues_[worker].begin = num_jobs * worker / num_workers_;
+      queues_[worker].end = num_jobs * (worker + 1) / num_workers_;
+    }
+    {
+      std::lock_guard<std::mutex> lock(mu_);
+      job_ = &job;
+      running_ = num_workers_;
+      generation_++;
+    }
+    start_cv_.notify_all();
+    Drain(0);
+    std::unique_lock<std::mutex> lock(mu_);
+    done_cv_.wait(lock, [this] { return running_ == 0; });
+    job_ = nullptr;
+  }
+
+ private:
+  struct alignas(64) Queue {
+    std::mutex mu;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+  };
+
+  bool Pop(std::size_t worker, std::size_t *job) {
+    Queue &queue = queues_[worker];
+    std::lock_guard<std::mutex> lock(queue.mu);
+    if (queue.begin == queue.end) {
+      return false;
+    }
+    *job = queue.begin++;
+    return true;
+  }
+
+  bool Steal(std::size_t thief, std::size_t *job) {
+    for (std::size_t i = 1; i < num_workers_; i++) {
+      Queue &victim = queues_[(thief + i) % num_workers_];
+      std::size_t begin;
+      std::size_t end;
+      {
+        std::lock_guard<std::mutex> lock(victim.mu);
+        std::size_t left = victim.end - victim.begin;
+        if (left == 0) {
+          continue;
+        }
+        end = victim.end;
+        victim.end -= (left + 1) / 2;
+        begin = victim.end;
+      }
+      *job = begin;
+      Queue &own = queues_[thief];
+      std::lock_guard<std::mutex> lock(own.mu);
+      own.begin = begin + 1;
+      own.end = end;
+      return true;
+    }
+    return false;
+  }
+
+  void Drain(std::size_t worker) {
+    std::size_t job;
+    while (Pop(worker, &job) || Steal(worker, &job)) {
+      (*job_)(job, worker);
+    }
+    std::lock_guard<std::mutex> lock(mu_);
+    if (--running_ == 0) {
+      done_cv_.notify_one();
+    }
+  }
+
+  void WorkerLoop(std::size_t worker) {
+    std::uint64_t seen = 0;
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(mu_);
+        start_cv_.wait(lock, [&] { return stop_ || generation_ != seen; });
+        if (stop_) {
+          return;
+        }
+        seen = generation_;
+      }
+      Drain(worker);
+    }
+  }
+
+  const std::size_t num_workers_;
+  std::unique_ptr<Queue[]> queues_;
+  std::vector<std::thread> threads_;
+  std::mutex mu_;
+  std::condition_variable start_cv_;
+  std::condition_variable done_cv_;
+  const Job *job_ = nullptr;
+  std::uint64_t generation_ = 0;
+  std::size_t running_ = 0;
+  bool stop_ = false;
+};
+
+// Attributes of a parsed task, kept by value until it becomes a TreeNode.
+// Comm names fit libstdc++'s 15 byte small string buffer, so building one
+// does not allocate.
+struct TaskRecord {
+  std::string name;
+  os_int pid;
+  os_int tgid;
+  os_int ppid;
+  os_int threads;
+  os_int uid = -1;
+  os_int rss_kb = -1;
+  os_int cpu_ticks = -1;
+  os_int start_ticks = -1;
+  os_int ns_level = 0;
+};
+
+// Copies the parsed |status| of a task into |record|.
+void ToTaskRecord(const ProcStatus &status, TaskRecord *record) {
+  record->name.assign(status.name.data(), status.name.size());
+  record->pid = status.pid;
+  record->tgid = status.tgid;
+  record->ppid = status.ppid;
+  record->threads = status.threads;
+  record->uid = status.uid;
+  record->rss_kb = status.rss_kb;
+  record->cpu_ticks = status.cpu_ticks;
+  record->start_ticks = status.start_ticks;
+  record->ns_level = status.ns_level;
+}
+
+// Enumerates every task from inside the kernel with a BPF "iter/task"
+// program. The program writes one packed TaskEntry per task and all of them
+// are read back from a single iterator fd, instead of three syscalls per task
+// against /proc. It needs CAP_BPF (or root) and a kernel with BTF; the offsets
+// of the task_struct fields are looked up in /sys/kernel/btf/vmlinux.
+class BpfTaskIterator {
+ public:
+  // Fills |records| in /proc scan order and returns true, or returns false
+  // with the reason in |error|.
+  static bool ReadTasks(std::vector<TaskRecord> *records, std::string *error) {
+    Btf btf;
+    if (!btf.Load("/sys/kernel/btf/vmlinux")) {
+      *error = "no kernel BTF";
+      return false;
+    }
+    Offsets offsets;
+    if (!FindOffsets(btf, &offsets)) {
+      *error = "task_struct layout not found in BTF";
+      return false;
+    }
+    std::uint32_t iter_func = btf.FindType(BTF_KIND_FUNC, "bpf_iter_task");
+    if (iter_func == 0) {
+      *error = "kernel has no task iterator";
+      return false;
+    }
+    std::vector<struct bpf_insn> prog = Assemble(offsets);
+    char log[4096] = {};
+    union bpf_attr attr = {};
+    attr.prog_type = BPF_PROG_TYPE_TRACING;
+    attr.expected_attach_type = BPF_TRACE_ITER;
+    attr.attach_btf_id = iter_func;
+    attr.insns = reinterpret_cast<std::uintptr_t>(prog.data());
+    attr.insn_cnt = prog.size();
+    // bpf_probe_read_kernel() and bpf_seq_write() are GPL only helpers, the
+    // embedded program is dual licensed accordingly.
+    attr.license = reinterpret_cast<std::uintptr_t>("Dual BSD/GPL");
+    attr.log_buf = reinterpret_cast<std::uintptr_t>(log);
+    attr.log_size = sizeof(log);
+    attr.log_level = 1;
+    memcpy(attr.prog_name, "pstree_tasks", sizeof("pstree_tasks"));
+    int prog_fd = Bpf(BPF_PROG_LOAD, &attr);
+    if (prog_fd < 0) {
+      *error = std::string("program load failed: ") + strerror(errno);
+      if (log[0] != '\0') {
+        *error += "\n";
+        *error += log;
+      }
+      return false;
+    }
+    attr = {};
+    attr.link_create.prog_fd = prog_fd;
+    attr.link_create.attach_type = BPF_TRACE_ITER;
+    int link_fd = Bpf(BPF_LINK_CREATE, &attr);
+    close(prog_fd);
+    if (link_fd < 0) {
+      *error = std::string("iterator link failed: ") + strerror(errno);
+      return false;
+    }
+    attr = {};
+    attr.iter_create.link_fd = link_fd;
+    int iter_fd = Bpf(BPF_ITER_CREATE, &attr);
+    close(link_fd);
+    if (iter_fd < 0) {
+      *error = std::string("iterator create failed: ") + strerror(errno);
+      return false;
+    }
+    std::vector<TaskEntry> entries;
+    bool ok = ReadEntries(iter_fd, &entries);
+    close(iter_fd);
+    if (!ok) {
+      *error = std::string("iterator read failed: ") + strerror(errno);
+      return false;
+    }
+    // Some kernels leave tasks out (init's thread group is missing under
+    // Firecracker), PsTree::BuildTree() reads those from /proc.
+    if (entries.empty()) {
+      *error = "iterator reported no tasks";
+      return false;
+    }
+    ToRecords(&entries, records);
+    return true;
+  }
+
+ private:
+  // The record the program emits per task.
+  struct TaskEntry {
+    std::uint32_t pid;
+    std::uint32_t tgid;
+    std::uint32_t ppid;
+    std::uint32_t threads;
+    char comm[16];
+  };
+  static_assert(sizeof(TaskEntry) == 32, "TaskEntry is written by BPF code");
+
+  // Byte offsets of the fields the program reads.
+  struct Offsets {
+    std::uint32_t pid;
+    std::uint32_t tgid;
+    std::uint32_t real_parent;
+    std::uint32_t signal;
+    std::uint32_t comm;
+    std::uint32_t nr_threads;  // In signal_struct.
+  };
+
+  // Just enough of a BTF reader to resolve names to type ids and member
+  // offsets, see Documentation/bpf/btf.rst.
+  class Btf {
+   public:
+    bool Load(const char *path) {
+      int fd = open(path, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return false;
+      }
+      char chunk[64 * 1024];
+      ssize_t n;
+      while ((n = read(fd, chunk, sizeof(chunk))) > 0) {
+        data_.insert(data_.end(), chunk, chunk + n);
+      }
+      close(fd);
+      if (data_.size() < sizeof(struct btf_header)) {
+        return false;
+      }
+      struct btf_header header;
+      memcpy(&header, data_.data(), sizeof(header));
+      if (header.magic != BTF_MAGIC ||
+          std::size_t{header.hdr_len} + header.str_off + header.str_len >
+              data_.size() ||
+          std::size_t{header.hdr_len} + header.type_off + header.type_len >
+              data_.size()) {
+        return false;
+      }
+      strings_ = data_.data() + header.hdr_len + header.str_off;
+      strings_len_ = header.str_len;
+      const char *p = data_.data() + header.hdr_len + header.type_off;
+      const char *end = p + header.type_len;
+      // Type ids start at 1, 0 is void.
+      types_.push_back(nullptr);
+      while (p + sizeof(struct btf_type) <= end) {
+        const struct btf_type *type = reinterpret_cast<const struct btf_type *>(p);
+        types_.push_back(type);
+        p += sizeof(struct btf_type) + ExtraSize(type);
+      }
+      return true;
+    }
+
+    std::uint32_t FindType(unsigned kind, std::string_view name) const {
+      for (std::uint32_t id = 1; id < types_.size(); id++) {
+        if (BTF_INFO_KIND(types_[id]->info) == kind &&
+            Name(types_[id]->name_off) == name) {
+          return id;
+        }
+      }
+      return 0;
+    }
+
+    // Finds |name| in struct |id|, descending into anonymous struct and union
+    // members, and returns its offset in bytes.
+    bool FindMember(std::uint32_t id, std::string_view name,
+                    std::uint32_t *offset) const {
+      const struct btf_type *type = types_[id];
+      unsigned kind = BTF_INFO_KIND(type->info);
+      if (kind != BTF_KIND_STRUCT && kind != BTF_KIND_UNION) {
+        return false;
+      }
+      const struct btf_member *members =
+          reinterpret_cast<const struct btf_member *>(type + 1);
+      for (unsigned i = 0; i < BTF_INFO_VLEN(type->info); i++) {
+        std::uint32_t bits = BTF_INFO_KFLAG(type->info)
+                                 ? BTF_MEMBER_BIT_OFFSET(members[i].offset)
+                                 : members[i].offset;
+        if (Name(members[i].name_off) == name) {
+          *offset = bits / 8;
+          return true;
+        }
+        std::uint32_t inner;
+        if (members[i].name_off == 0 && members[i].type < types_.size() &&
+            FindMember(members[i].type, name, &inner)) {
+          *offset = bits / 8 + inner;
+          return true;
+        }
+      }
+      return false;
+    }
+
+   private:
+    static std::size_t ExtraSize(const struct btf_type *type) {
+      unsigned vlen = BTF_INFO_VLEN(type->info);
+      switch (BTF_INFO_KIND(type->info)) {
+        case BTF_KIND_INT:
+        case BTF_KIND_VAR:
+        case BTF_KIND_DECL_TAG:
+          return 4;
+        case BTF_KIND_ARRAY:
+          return sizeof(struct btf_array);
+        case BTF_KIND_STRUCT:
+        case BTF_KIND_UNION:
+          return vlen * sizeof(struct btf_member);
+        case BTF_KIND_ENUM:
+          return vlen * sizeof(struct btf_enum);
+        case BTF_KIND_FUNC_PROTO:
+          return vlen * sizeof(struct btf_param);
+        case BTF_KIND_DATASEC:
+          return vlen * sizeof(struct btf_var_secinfo);
+        case BTF_KIND_ENUM64:
+          return vlen * sizeof(struct btf_enum64);
+        default:
+          return 0;
+      }
+    }
+
+    std::string_view Name(std::uint32_t off) const {
+      if (off >= strings_len_) {
+        return std::string_view();
+      }
+      return std::string_view(strings_ + off);
+    }
+
+    std::vector<char> data_;
+    const char *strings_ = nullptr;
+    std::uint32_t strings_len_ = 0;
+    std::vector<const struct btf_type *> types_;
+  };
+
+  static bool FindOffsets(const Btf &btf, Offsets *offsets) {
+    std::uint32_t task = btf.FindType(BTF_KIND_STRUCT, "task_struct");
+    std::uint32_t signal = btf.FindType(BTF_KIND_STRUCT, "signal_struct");
+    if (task == 0 || signal == 0 ||
+        !btf.FindMember(task, "pid", &offsets->pid) ||
+        !btf.FindMember(task, "tgid", &offsets->tgid) ||
+        !btf.FindMember(task, "real_parent", &offsets->real_parent) ||
+        !btf.FindMember(task, "signal", &offsets->signal) ||
+        !btf.FindMember(task, "comm", &offsets->comm) ||
+        !btf.FindMember(signal, "nr_threads", &offsets->nr_threads)) {
+      return false;
+    }
+    // Loads take a 16-bit displacement.
+    for (std::uint32_t offset : {offsets->pid, offsets->tgid,
+                                 offsets->real_parent, offsets->signal,
+                                 offsets->comm, offsets->nr_threads}) {
+      if (offset > INT16_MAX) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  static struct bpf_insn Insn(std::uint8_t code, std::uint8_t dst,
+                              std::uint8_t src, std::int16_t off,
+                              std::int32_t imm) {
+    struct bpf_insn insn = {};
+    insn.code = code;
+    insn.dst_reg = dst;
+    insn.src_reg = src;
+    insn.off = off;
+    insn.imm = imm;
+    return insn;
+  }
+
+  // The program, with the TaskEntry at r10 - 32:
+  //
+  //   r6 = ctx->task; r7 = ctx->meta
+  //   if (!r6) return 0
+  //   entry.pid = r6->pid; entry.tgid = r6->tgid
+  //   entry.ppid = r6->real_parent ? r6->real_parent->tgid : 0
+  //   entry.threads = r6->signal ? r6->signal->nr_threads : 0
+  //   bpf_probe_read_kernel(entry.comm, 16, r6->comm)
+  //   bpf_seq_write(r7->seq, &entry, 32)
+  //   return 0
+  static std::vector<struct bpf_insn> Assemble(const Offsets &off) {
+    const std::uint8_t kLdxDW = BPF_LDX | BPF_MEM | BPF_DW;
+    const std::uint8_t kLdxW = BPF_LDX | BPF_MEM | BPF_W;
+    const std::uint8_t kStxW = BPF_STX | BPF_MEM | BPF_W;
+    const std::uint8_t kMovImm = BPF_ALU64 | BPF_MOV | BPF_K;
+    const std::uint8_t kMovReg = BPF_ALU64 | BPF_MOV | BPF_X;
+    const std::uint8_t kAddImm = BPF_ALU64 | BPF_ADD | BPF_K;
+    const std::uint8_t kJeqImm = BPF_JMP | BPF_JEQ | BPF_K;
+    const std::uint8_t kCall = BPF_JMP | BPF_CALL;
+    std::vector<struct bpf_insn> p = {
+        // struct bpf_iter__task { struct bpf_iter_meta *meta; task *task; }
+        Insn(kLdxDW, BPF_REG_6, BPF_REG_1, 8, 0),
+        Insn(kLdxDW, BPF_REG_7, BPF_REG_1, 0, 0),
+        // Patched below to jump to the final "return 0".
+        Insn(kJeqImm, BPF_REG_6, 0, 0, 0),
+        Insn(kLdxW, BPF_REG_2, BPF_REG_6, off.pid, 0),
+        Insn(kStxW, BPF_REG_10, BPF_REG_2, -32, 0),
+        Insn(kLdxW, BPF_REG_2, BPF_REG_6, off.tgid, 0),
+        Insn(kStxW, BPF_REG_10, BPF_REG_2, -28, 0),
+        Insn(kLdxDW, BPF_REG_8, BPF_REG_6, off.real_parent, 0),
+        Insn(kMovImm, BPF_REG_2, 0, 0, 0),
+        Insn(kJeqImm, BPF_REG_8, 0, 1, 0),
+        Insn(kLdxW, BPF_REG_2, BPF_REG_8, off.tgid, 0),
+        Insn(kStxW, BPF_REG_10, BPF_REG_2, -24, 0),
+        Insn(kLdxDW, BPF_REG_8, BPF_REG_6, off.signal, 0),
+        Insn(kMovImm, BPF_REG_2, 0, 0, 0),
+        Insn(kJeqImm, BPF_REG_8, 0, 1, 0),
+        Insn(kLdxW, BPF_REG_2, BPF_REG_8, off.nr_threads, 0),
+        Insn(kStxW, BPF_REG_10, BPF_REG_2, -20, 0),
+        Insn(kMovReg, BPF_REG_1, BPF_REG_10, 0, 0),
+        Insn(kAddImm, BPF_REG_1, 0, 0, -16),
+        Insn(kMovImm, BPF_REG_2, 0, 0, 16),
+        Insn(kMovReg, BPF_REG_3, BPF_REG_6, 0, 0),
+        Insn(kAddImm, BPF_REG_3, 0, 0, off.comm),
+        Insn(kCall, 0, 0, 0, BPF_FUNC_probe_read_kernel),
+        // struct bpf_iter_meta { struct seq_file *seq; ... }
+        Insn(kLdxDW, BPF_REG_1, BPF_REG_7, 0, 0),
+        Insn(kMovReg, BPF_REG_2, BPF_REG_10, 0, 0),
+        Insn(kAddImm, BPF_REG_2, 0, 0, -32),
+        Insn(kMovImm, BPF_REG_3, 0, 0, sizeof(TaskEntry)),
+        Insn(kCall, 0, 0, 0, BPF_FUNC_seq_write),
+        Insn(kMovImm, BPF_REG_0, 0, 0, 0),
+        Insn(BPF_JMP | BPF_EXIT, 0, 0, 0, 0),
+    };
+    const std::size_t kNullCheck = 2;
+    p[kNullCheck].off =
+        static_cast<std::int16_t>(p.size() - 2 - (kNullCheck + 1));
+    return p;
+  }
+
+  static bool ReadEntries(int fd, std::vector<TaskEntry> *entries) {
+    std::vector<char> data;
+    char chunk[64 * 1024];
+    for (;;) {
+      ssize_t n = read(fd, chunk, sizeof(chunk));
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // The iterator restarts on EAGAIN only when nothing has been read.
+        return false;
+      }
+      if (n == 0) {
+        break;
+      }
+      data.insert(data.end(), chunk, chunk + n);
+    }
+    entries->resize(data.size() / sizeof(TaskEntry));
+    memcpy(entries->data(), data.data(), entries->size() * sizeof(TaskEntry));
+    return true;
+  }
+
+  // Tasks come out in tid order; put each process first with its threads
+  // right after it, named after the process, as a /proc scan does.
+  static void ToRecords(std::vector<TaskEntry> *entries,
+                        std::vector<TaskRecord> *records) {
+    std::sort(entries->begin(), entries->end(),
+              [](const TaskEntry &a, const TaskEntry &b) {
+                bool a_thread = a.pid != a.tgid;
+                bool b_thread = b.pid != b.tgid;
+                if (a.tgid != b.tgid) {
+                  return a.tgid < b.tgid;
+                }
+                if (a_thread != b_thread) {
+                  return b_thread;
+                }
+                return a.pid < b.pid;
+              });
+    records->reserve(entries->size());
+    for (const TaskEntry &entry : *entries) {
+      TaskRecord record;
+      if (entry.pid != entry.tgid && !records->empty() &&
+          records->back().tgid == static_cast<os_int>(entry.tgid)) {
+        record.name = records->back().name;
+      } else {
+        record.name.assign(entry.comm, strnlen(entry.comm, sizeof(entry.comm)));
+      }
+      record.pid = entry.pid;
+      record.tgid = entry.tgid;
+      record.ppid = entry.ppid;
+      record.threads = entry.threads;
+      records->push_back(std::move(record));
+    }
+  }
+
+  static int Bpf(int cmd, union bpf_attr *attr) {
+    return static_cast<int>(syscall(__NR_bpf, cmd, attr, sizeof(*attr)));
+  }
+};
+
+// Reads the status (or stat) files of many tasks through an io_uring. Every
+// task is a chain of three linked requests: an openat into a direct
+// descriptor, a read into the task's slot of a registered buffer and a close
+// of the descriptor. The read and the close are hard linked because every
+// status read is short, which would cancel the rest of a soft linked chain.
+// Up to kSlots chains are in flight and each io_uring_enter() both submits
+// the chains of the slots that came free and waits for half of the requests
+// outstanding, so a few hundred files cost a handful of syscalls instead of
+// three each. Direct descriptors need Linux 5.15; on an older kernel the
+// openats fail with EINVAL and the tasks are left to the synchronous path.
+class UringReader {
+ public:
+  // Returns the reader, or nullptr with the reason in |error| when io_uring
+  // is not available.
+  static std::unique_ptr<UringReader> Create(std::string *error) {
+    std::unique_ptr<UringReader> reader(new UringReader());
+    if (!reader->Setup(error)) {
+      return nullptr;
+    }
+    return reader;
+  }
+
+  ~UringReader() {
+    if (buffers_ != MAP_FAILED) {
+      munmap(buffers_, kSlots * kProcFileBufSize);
+    }
+    if (sqes_ != MAP_FAILED) {
+      munmap(sqes_, sqes_size_);
+    }
+    if (ring_ != MAP_FAILED) {
+      munmap(ring_, ring_size_);
+    }
+  }
+
+  // Reads the file of each of the |count| processes |pids| listed in
+  // |dir_fd| and parses it with |parse| into |records|. |errors| is set to 0
+  // for a parsed file, to the errno of one that could not be read, or to -1
+  // for one this reader could not handle, too large for its buffer slot for
+  // instance, that is left to ReadProcStatus().
+  void ReadTasks(int dir_fd, const os_int *pids, std::size_t count,
+                 ProcFormat format, ProcParser parse, os_int uid_filter,
+                 TaskRecord *records, int *errors) {
+    std::size_t next = 0;
+    unsigned outstanding = 0;
+    unsigned unsubmitted = 0;
+    while (next < count || outstanding > 0) {
+      while (next < count && !free_slots_.empty()) {
+        unsigned slot = free_slots_.back();
+        free_slots_.pop_back();
+        job_[slot] = next;
+        errors[next] = 0;
+        QueueChain(dir_fd, slot, TaskPath(pids[next], ProcFileName(format),
+                                           paths_[slot]));
+        pending_[slot] = 3;
+        outstanding += 3;
+        unsubmitted += 3;
+        next++;
+      }
+      int submitted = syscall(__NR_io_uring_enter, ring_fd_.Get(),
+                              unsubmitted, (outstanding + 1) / 2,
+                              IORING_ENTER_GETEVENTS, nullptr, 0);
+      PSTREE_COUNT(kSyscalls, 1);
+      if (submitted < 0) {
+        if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+          // The ring broke, whatever was not read yet is read synchronously.
+          for (; next < count; next++) {
+            errors[next] = -1;
+          }
+          Abandon(errors, &outstanding);
+          return;
+        }
+        submitted = 0;
+      }
+      unsubmitted -= submitted;
+      outstanding -= Reap(parse, uid_filter, records, errors);
+    }
+  }
+
+ private:
+  // Chains in flight, each with its own direct descriptor and buffer slot.
+  static constexpr unsigned kSlots = 256;
+  static constexpr unsigned kEntries = 4 * kSlots;
+  // A request's user_data is its slot, shifted, and what it is.
+  enum Op : std::uint64_t { kOpen, kRead, kClose };
+
+  UringReader() {
+    for (unsigned slot = kSlots; slot-- > 0;) {
+      free_slots_.push_back(slot);
+    }
+  }
+
+  bool Setup(std::string *error) {
+    struct io_uring_params params = {};
+    ring_fd_.Reset(syscall(__NR_io_uring_setup, kEntries, &params));
+    if (ring_fd_.Get() < 0) {
+      *error = std::string("io_uring_setup failed: ") + strerror(errno);
+      return false;
+    }
+    if ((params.features & IORING_FEAT_SINGLE_MMAP) == 0) {
+      *error = "kernel too old";
+      return false;
+    }
+    ring_size_ = std::max<std::size_t>(
+        params.sq_off.array + params.sq_entries * sizeof(unsigned),
+        params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe));
+    ring_ = mmap(nullptr, ring_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_.Get(), IORING_OFF_SQ_RING);
+    sqes_size_ = params.sq_entries * sizeof(struct io_uring_sqe);
+    sqes_ = mmap(nullptr, sqes_size_, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ring_fd_.Get(), IORING_OFF_SQES);
+    buffers_ = mmap(nullptr, kSlots * kProcFileBufSize, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring_ == MAP_FAILED || sqes_ == MAP_FAILED || buffers_ == MAP_FAILED) {
+      *error = std::string("mmap failed: ") + strerror(errno);
+      return false;
+    }
+    char *ring = static_cast<char *>(ring_);
+    sq_tail_ = reinterpret_cast<unsigned *>(ring + params.sq_off.tail);
+    sq_mask_ = *reinterpret_cast<unsigned *>(ring + params.sq_off.ring_mask);
+    sq_array_ = reinterpret_cast<unsigned *>(ring + params.sq_off.array);
+    cq_head_ = reinterpret_cast<unsigned *>(ring + params.cq_off.head);
+    cq_tail_ = reinterpret_cast<unsigned *>(ring + params.cq_off.tail);
+    cq_mask_ = *reinterpret_cast<unsigned *>(ring + params.cq_off.ring_mask);
+    cqes_ = reinterpret_cast<struct io_uring_cqe *>(ring + params.cq_off.cqes);
+
+    // A sparse table for the openats to install their descriptor into.
+    std::vector<int> files(kSlots, -1);
+    if (syscall(__NR_io_uring_register, ring_fd_.Get(), IORING_REGISTER_FILES,
+                files.data(), kSlots) < 0) {
+      *error = std::string("registering files failed: ") + strerror(errno);
+      return false;
+    }
+    // Registered buffers count against RLIMIT_MEMLOCK, plain reads into the
+    // same slots do without.
+    struct iovec iov = {buffers_, kSlots * kProcFileBufSize};
+    fixed_buffers_ = syscall(__NR_io_uring_register, ring_fd_.Get(),
+                             IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+    return true;
+  }
+
+  struct io_uring_sqe *NextSqe() {
+    unsigned index = sq_tail_local_ & sq_mask_;
+    struct io_uring_sqe *sqe = static_cast<struct io_uring_sqe *>(sqes_) + index;
+    memset(sqe, 0, sizeof(*sqe));
+    sq_array_[index] = index;
+    sq_tail_local_++;
+    return sqe;
+  }
+
+  // Queues openat |path|, read and close into |slot|. At most kSlots chains
+  // are in flight, so the 4 * kSlots entries never run out.
+  void QueueChain(int dir_fd, unsigned slot, const char *path) {
+    std::uint64_t tag = static_cast<std::uint64_t>(slot) << 2;
+    struct io_uring_sqe *sqe = NextSqe();
+    sqe->opcode = IORING_OP_OPENAT;
+    sqe->fd = dir_fd;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(path);
+    // Direct descriptors are never inherited, O_CLOEXEC is refused for them.
+    sqe->open_flags = O_RDONLY;
+    sqe->file_index = slot + 1;
+    sqe->flags = IOSQE_IO_LINK;
+    sqe->user_data = tag | kOpen;
+
+    sqe = NextSqe();
+    sqe->opcode = fixed_buffers_ ? IORING_OP_READ_FIXED : IORING_OP_READ;
+    sqe->fd = slot;
+    sqe->addr = reinterpret_cast<std::uintptr_t>(Buffer(slot));
+    sqe->len = kProcFileBufSize;
+    sqe->buf_index = 0;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_HARDLINK;
+    sqe->user_data = tag | kRead;
+
+    sqe = NextSqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->file_index = slot + 1;
+    sqe->user_data = tag | kClose;
+    __atomic_store_n(sq_tail_, sq_tail_local_, __ATOMIC_RELEASE);
+  }
+
+  char *Buffer(unsigned slot) const {
+    return static_cast<char *>(buffers_) + slot * kProcFileBufSize;
+  }
+
+  // Handles every completion there is and returns how many there were.
+  unsigned Reap(ProcParser parse, os_int uid_filter, TaskRecord *records,
+                int *errors) {
+    unsigned head = *cq_head_;
+    unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+    unsigned reaped = tail - head;
+    for (; head != tail; head++) {
+      const struct io_uring_cqe &cqe = cqes_[head & cq_mask_];
+      unsigned slot = static_cast<unsigned>(cqe.user_data >> 2);
+      std::size_t job = job_[slot];
+      switch (cqe.user_data & 3) {
+        case kOpen:
+          if (cqe.res < 0) {
+            // EINVAL: no direct descriptors before Linux 5.15.
+            errors[job] = (cqe.res == -EINVAL ? -1 : -cqe.res);
+            if (IsVanished(-cqe.res)) {
+              PSTREE_COUNT(kVanished, 1);
+            }
+          }
+          break;
+        case kRead:
+          if (cqe.res == -ECANCELED) {
+            // The openat failed.
+          } else if (cqe.res < 0) {
+            errors[job] = -cqe.res;
+            if (IsVanished(-cqe.res)) {
+              PSTREE_COUNT(kVanished, 1);
+            }
+          } else if (static_cast<std::size_t>(cqe.res) == kProcFileBufSize) {
+            // May have been cut short, read again with room to spill into.
+            errors[job] = -1;
+          } else {
+            PSTREE_COUNT(kBytesRead, cqe.res);
+            ProcStatus status;
+            parse(Buffer(slot), cqe.res, -1, uid_filter, &status);
+            ToTaskRecord(status, &records[job]);
+          }
+          break;
+        case kClose:
+          break;
+      }
+      if (--pending_[slot] == 0) {
+        free_slots_.push_back(slot);
+      }
+    }
+    __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    return reaped;
+  }
+
+  // Waits out the |outstanding| requests of a ring that cannot be entered
+  // normally anymore, leaving their tasks to the synchronous path.
+  void Abandon(int *errors, unsigned *outstanding) {
+    for (unsigned slot = 0; slot < kSlots; slot++) {
+      if (pending_[slot] > 0) {
+        errors[job_[slot]] = -1;
+      }
+    }
+    // The buffers and paths must outlive requests the kernel still runs.
+    while (*outstanding > 0) {
+      if (syscall(__NR_io_uring_enter, ring_fd_.Get(), 0, 1,
+                  IORING_ENTER_GETEVENTS, nullptr, 0) < 0 &&
+          errno != EINTR) {
+        break;
+      }
+      unsigned head = *cq_head_;
+      unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+      for (; head != tail; head++) {
+        unsigned slot = static_cast<unsigned>(cqes_[head & cq_mask_].user_data >> 2);
+        if (--pending_[slot] == 0) {
+          free_slots_.push_back(slot);
+        }
+        (*outstanding)--;
+      }
+      __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+    }
+  }
+
+  ScopedFd ring_fd_;
+  void *ring_ = MAP_FAILED;
+  std::size_t ring_size_ = 0;
+  void *sqes_ = MAP_FAILED;
+  std::size_t sqes_size_ = 0;
+  void *buffers_ = MAP_FAILED;
+  bool fixed_buffers_ = false;
+  unsigned *sq_tail_ = nullptr;
+  unsigned sq_tail_local_ = 0;
+  unsigned sq_mask_ = 0;
+  unsigned *sq_array_ = nullptr;
+  unsigned *cq_head_ = nullptr;
+  unsigned *cq_tail_ = nullptr;
+  unsigned cq_mask_ = 0;
+  struct io_uring_cqe *cqes_ = nullptr;
+  // The path, job and requests outstanding of every slot.
+  char paths_[kSlots][64];
+  std::size_t job_[kSlots] = {};
+  unsigned pending_[kSlots] = {};
+  std::vector<unsigned> free_slots_;
+};
+
+// Size of the buffer the tree is rendered into before it is written out.
+constexpr std::size_t kOutputBufSize = 64 * 1024;
+
+// Collects output in a fixed buffer and hands it to write(2) whenever it would
+// overflow, so memory use does not depend on how much gets written. It can
+// also collect into a string, for callers that need the whole output.
+class OutputBuffer {
+ public:
+  explicit OutputBuffer(int fd) : fd_(fd) {}
+  explicit OutputBuffer(std::string *sink) : sink_(sink) {}
+  ~OutputBuffer() { Flush(); }
+
+  OutputBuffer(const OutputBuffer &) = delete;
+  OutputBuffer &operator=(const OutputBuffer &) = delete;
+
+  void Append(const char *data, std::size_t len) {
+    if (len <= sizeof(buf_) - len_) {
+      memcpy(buf_ + len_, data, len);
+      len_ += len;
+      return;
+    }
+    if (len < sizeof(buf_)) {
+      Flush();
+      memcpy(buf_, data, len);
+      len_ = len;
+      return;
+    }
+    // Too large to buffer, write it together with what is pending.
+    struct iovec iov[2] = {{buf_, len_}, {const_cast<char *>(data), len}};
+    WriteAll(iov, 2);
+    len_ = 0;
+  }
+
+  void Append(std::string_view str) { Append(str.data(), str.size()); }
+
+  void Put(char c) {
+    if (len_ == sizeof(buf_)) {
+      Flush();
+    }
+    buf_[len_++] = c;
+  }
+
+  // Appends |value| in decimal and returns the number of digits written.
+  std::size_t AppendInt(os_int value) {
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    bool negative = value < 0;
+    std::uint64_t v = negative ? 0 - static_cast<std::uint64_t>(value)
+                               : static_cast<std::uint64_t>(value);
+    do {
+      *--p = static_cast<char>('0' + v % 10);
+      v /= 10;
+    } while (v != 0);
+    if (negative) {
+      *--p = '-';
+    }
+    Append(p, end - p);
+    return end - p;
+  }
+
+  void Flush() {
+    if (len_ > 0) {
+      struct iovec iov = {buf_, len_};
+      WriteAll(&iov, 1);
+      len_ = 0;
+    }
+  }
+
+  // Writes what is pending and the |iovcnt| buffers of |iov| with a single
+  // writev() whenever the fd takes it all at once.
+  void AppendV(const struct iovec *iov, int iovcnt) {
+    constexpr int kMaxIov = 8;
+    assert(iovcnt < kMaxIov);
+    struct iovec all[kMaxIov] = {{buf_, len_}};
+    std::copy(iov, iov + iovcnt, all + 1);
+    WriteAll(all, iovcnt + 1);
+    len_ = 0;
+  }
+
+ private:
+  void WriteAll(struct iovec *iov, int iovcnt) {
+    if (sink_ != nullptr) {
+      for (int i = 0; i < iovcnt; i++) {
+        sink_->append(static_cast<const char *>(iov[i].iov_base),
+                      iov[i].iov_len);
+      }
+      return;
+    }
+    while (iovcnt > 0) {
+      ssize_t n = writev(fd_, iov, iovcnt);
+      PSTREE_COUNT(kSyscalls, 1);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // Nobody is reading (EPIPE, closed fd), drop the output.
+        return;
+      }
+      while (iovcnt > 0 && static_cast<std::size_t>(n) >= iov->iov_len) {
+        n -= iov->iov_len;
+        iov++;
+        iovcnt--;
+      }
+      if (iovcnt > 0) {
+        iov->iov_base = static_cast<char *>(iov->iov_base) + n;
+        iov->iov_len -= n;
+      }
+    }
+  }
+
+  int fd_ = -1;
+  std::string *sink_ = nullptr;
+  std::size_t len_ = 0;
+  char buf_[kOutputBufSize];
+};
+
+// Shows a sequence of rendered frames. On a terminal only the lines that
+// differ from the previous frame are rewritten, in place, through cursor
+// addressing; anything else just gets every frame in full.
+class FramePainter {
+ public:
+  FramePainter(int fd, bool is_tty) : fd_(fd), is_tty_(is_tty) {}
+
+  void Paint(const std::string &frame) {
+    OutputBuffer out(fd_);
+    if (!is_tty_) {
+      out.Append(frame);
+      out.Append("\n\n", 2);
+      return;
+    }
+    if (first_) {
+      // Home the cursor and clear the screen.
+      out.Append("\x1b[H\x1b[2J", 7);
+      first_ = false;
+    }
+    lines_.clear();
+    std::size_t pos = 0;
+    while (pos <= frame.size()) {
+      std::size_t eol = frame.find('\n', pos);
+      if (eol == std::string::npos) {
+        eol = frame.size();
+      }
+      lines_.push_back(std::string_view(frame.data() + pos, eol - pos));
+      pos = eol + 1;
+    }
+    for (std::size_t row = 0; row < lines_.size(); row++) {
+      if (row < prev_lines_.size() && prev_lines_[row] == lines_[row]) {
+        continue;
+      }
+      // Move to the row, rewrite it and clear what is left of the old line.
+      out.Append("\x1b[", 2);
+      out.AppendInt(static_cast<os_int>(row + 1));
+      out.Append(";1H", 3);
+      out.Append(lines_[row]);
+      out.Append("\x1b[K", 3);
+    }
+    if (prev_lines_.size() > lines_.size()) {
+      out.Append("\x1b[", 2);
+      out.AppendInt(static_cast<os_int>(lines_.size() + 1));
+      out.Append(";1H\x1b[J", 6);
+    }
+    // Park the cursor below the tree.
+    out.Append("\x1b[", 2);
+    out.AppendInt(static_cast<os_int>(lines_.size() + 1));
+    out.Append(";1H", 3);
+    prev_frame_ = frame;
+    prev_lines_.clear();
+    for (std::string_view line : lines_) {
+      prev_lines_.push_back(
+          std::string_view(prev_frame_.data() + (line.data() - frame.data()),
+                           line.size()));
+    }
+  }
+
+ private:
+  int fd_;
+  bool is_tty_;
+  bool first_ = true;
+  std::string prev_frame_;
+  std::vector<std::string_view> lines_;
+  std::vector<std::string_view> prev_lines_;
+};
+
+// Groups identical sibling subtrees so they are drawn once as N*[name]. Every
+// subtree gets a class id, hash-consed bottom-up from its label and the
+// classes and counts of its grouped children, so one post-order pass over the
+// tree does it. Identical siblings need not be adjacent, a group sits where
+// its first member is.
+class SubtreeFolder {
+ public:
+  // |child| is the position of the first member in its parent's Children().
+  struct Group {
+    std::uint32_t child;
+    std::uint32_t count;
+  };
+
+  // Folds the trees of |roots|, walked on |stack|. |num_nodes| bounds the
+  // node indices of the tree. Thread counts are part of a subtree when
+  // |compact_threads| draws them.
+  void Fold(const std::vector<NodeView> &roots, std::size_t num_nodes,
+            bool compact_threads, WalkStack *stack) {
+    first_group_.assign(num_nodes, 0);
+    num_groups_.assign(num_nodes, 0);
+    class_.assign(num_nodes, 0);
+    groups_.clear();
+    classes_.clear();
+    for (NodeView root : roots) {
+      stack->clear();
+      stack->push_back(WalkFrame{root});
+      while (!stack->empty()) {
+        WalkFrame &frame = stack->back();
+        if (frame.next < frame.node.Children().size()) {
+          NodeView child = frame.node.Children()[frame.next++];
+          stack->push_back(WalkFrame{child});
+          continue;
+        }
+        FoldNode(frame.node, compact_threads);
+        stack->pop_back();
+      }
+    }
+  }
+
+  std::size_t NumGroups(NodeIndex index) const { return num_groups_[index]; }
+
+  const Group &GroupAt(NodeIndex index, std::size_t i) const {
+    return groups_[first_group_[index] + i];
+  }
+
+ private:
+  void FoldNode(NodeView node, bool compact_threads) {
+    NodeIndex index = node.Index();
+    const NodeView::ChildRange children = node.Children();
+    first_group_[index] = groups_.size();
+    for (std::uint32_t i = 0; i < children.size(); i++) {
+      std::uint32_t cls = class_[children[i].Index()];
+      if (cls >= group_of_class_.size()) {
+        group_of_class_.resize(cls + 1, 0);
+        owner_of_class_.resize(cls + 1, kNoNode);
+      }
+      if (owner_of_class_[cls] == index) {
+        groups_[group_of_class_[cls]].count++;
+        continue;
+      }
+      owner_of_class_[cls] = index;
+      group_of_class_[cls] = groups_.size();
+      groups_.push_back({i, 1});
+    }
+    num_groups_[index] = groups_.size() - first_group_[index];
+
+    key_.assign(node->Name());
+    key_.push_back('\0');
+    key_.push_back(node->is_thread ? 't' : 'p');
+    if (compact_threads) {
+      AppendKey(node->num_threads);
+    }
+    for (std::size_t i = 0; i < num_groups_[index]; i++) {
+      const Group &group = GroupAt(index, i);
+      AppendKey(class_[children[group.child].Index()]);
+      AppendKey(group.count);
+    }
+    class_[index] =
+        classes_.emplace(key_, static_cast<std::uint32_t>(classes_.size()))
+            .first->second;
+  }
+
+  template <typename Int>
+  void AppendKey(Int value) {
+    key_.append(reinterpret_cast<const char *>(&value), sizeof(value));
+  }
+
+  std::vector<std::uint32_t> first_group_;
+  std::vector<std::uint32_t> num_groups_;
+  std::vector<std::uint32_t> class_;
+  std::vector<Group> groups_;
+  // Scratch of FoldNode(): the group a class of children went to and the
+  // node whose children were being grouped then.
+  std::vector<std::uint32_t> group_of_class_;
+  std::vector<NodeIndex> owner_of_class_;
+  std::unordered_map<std::string, std::uint32_t> classes_;
+  std::string key_;
+};
+
+// What a drawn node shows next to its name, a set fixed at compile time: each
+// combination gets its own TreeRenderer, with no flag checks per node.
+enum Column : unsigned {
+  kColumnPid = 1 << 0,        // -p
+  kColumnResources = 1 << 1,  // --resources
+  kColumnArgs = 1 << 2,       // -a
+};
+
+constexpr unsigned kAllColumns = kColumnPid | kColumnResources | kColumnArgs;
+
+// The columns of a node drawn with or without its pid, resources and
+// arguments.
+constexpr unsigned Columns(bool show_pids, bool resources, bool args) {
+  return (show_pids ? kColumnPid : 0u) | (resources ? kColumnResources : 0u) |
+         (args ? kColumnArgs : 0u);
+}
+
+// Calls |fn| with std::integral_constant<unsigned, |columns|>, so that
+// fn(columns) can use decltype(columns)::value as a template argument. The
+// one branch on the set at runtime, a chain of compares over every set.
+template <unsigned kColumns = 0, typename Fn>
+void WithColumns(unsigned columns, Fn &&fn) {
+  if constexpr (kColumns == kAllColumns) {
+    fn(std::integral_constant<unsigned, kColumns>());
+  } else if (columns == kColumns) {
+    fn(std::integral_constant<unsigned, kColumns>());
+  } else {
+    WithColumns<kColumns + 1>(columns, std::forward<Fn>(fn));
+  }
+}
+
+// How much of a tree is drawn: |max_depth| levels below each root and lines
+// of |width| columns, as GNU pstree clips them to the terminal: the rest of a
+// longer line is a single '+'. 0 leaves lines whole.
+struct RenderLimits {
+  std::size_t max_depth = SIZE_MAX;
+  std::size_t width = 0;
+};
+
+// Streams a tree in the ascii art layout into an OutputBuffer:
+//
+//   init--+--a--+--{a}
+//         |     |--b
+//         |--c-----d
+//
+// The branch columns of the ancestors are kept in prefix_ as the exact bytes
+// that start a sibling's line, so a line costs one copy of the prefix and the
+// label, and nothing is allocated once the deepest level has been seen.
+// Subtrees past |limits| are not descended into, and nothing past the width
+// of a line is formatted, only measured for the columns of the lines below.
+// The walk keeps a WalkFrame per level, on |stack| when given. Labels have
+// the Column set |kColumns|. With kColumnArgs, whose labels are too long to
+// have their children beside them, every label goes on a line of its own,
+// below its parent's and indented from it:
+//
+//   init
+//     |--sshd -D
+//     |    |--sshd alice [priv]
+//     |--cron -f
+template <unsigned kColumns>
+class TreeRenderer {
+ public:
+  // Identical subtrees are drawn once when |folder| has grouped them, and
+  // with kColumnResources processes get their resources and those of their
+  // subtree, indexed by node, from |totals|.
+  TreeRenderer(OutputBuffer *out, bool compact_threads,
+               const SubtreeFolder *folder = nullptr,
+               const std::vector<ResourceTotal> *totals = nullptr,
+               RenderLimits limits = RenderLimits(),
+               WalkStack *stack = nullptr)
+      : out_(out),
+        compact_threads_(compact_threads),
+        folder_(folder),
+        totals_(totals),
+        limits_(limits),
+        stack_(stack != nullptr ? stack : &own_stack_) {}
+
+  void Render(NodeView root) {
+    prefix_.clear();
+    column_ = 0;
+    if (!root) {
+      return;
+    }
+    stack_->clear();
+    EnterNode(root, 0, 1, 0);
+    while (!stack_->empty()) {
+      WalkFrame &frame = stack_->back();
+      std::uint32_t num_children = NumChildren(frame.node);
+      if (frame.next == num_children) {
+        prefix_.resize(frame.prefix_len);
+        std::uint32_t count = frame.count;
+        stack_->pop_back();
+        if (count > 1) {
+          Emit(']');
+        }
+        continue;
+      }
+      std::uint32_t cid = frame.next++;
+      if (cid > 0 || kOwnLines) {
+        NewLine();
+      }
+      if (cid + 1 == num_children) {
+        prefix_.back() = ' ';
+      }
+      std::uint32_t groups = NumThreadGroups(frame.node);
+      if (cid < groups) {
+        WriteThreadGroup(*frame.node);
+        continue;
+      }
+      // Entering the child may grow the stack, |frame| is not used after.
+      NodeView node = frame.node;
+      std::size_t start_pos = frame.branch_pos + 2;
+      std::size_t depth = frame.depth + 1;
+      if (folder_ != nullptr) {
+        const SubtreeFolder::Group &group =
+            folder_->GroupAt(node.Index(), cid - groups);
+        EnterNode(node.Children()[group.child], start_pos, group.count, depth);
+      } else {
+        EnterNode(node.Children()[cid - groups], start_pos, 1, depth);
+      }
+    }
+  }
+
+ private:
+  static constexpr bool kOwnLines = (kColumns & kColumnArgs) != 0;
+
+  // Whether the current line already reached its width, everything else on
+  // it is dropped.
+  bool Clipped() const {
+    return limits_.width != 0 && column_ > limits_.width;
+  }
+
+  // Writes what fits of |data| on the current line, and the '+' once it
+  // runs over.
+  void Emit(const char *data, std::size_t len) {
+    if (limits_.width == 0) {
+      out_->Append(data, len);
+      return;
+    }
+    if (column_ < limits_.width) {
+      out_->Append(data, std::min(len, limits_.width - column_));
+    }
+    if (column_ <= limits_.width && column_ + len > limits_.width) {
+      out_->Put('+');
+    }
+    column_ += len;
+  }
+
+  void Emit(std::string_view str) { Emit(str.data(), str.size()); }
+
+  void Emit(char c) { Emit(&c, 1); }
+
+  // Emits |value|, a pid or count, in decimal and returns the number of
+  // digits.
+  std::size_t EmitInt(os_int value) {
+    if (limits_.width == 0) {
+      return out_->AppendInt(value);
+    }
+    if (Clipped()) {
+      std::size_t len = NumDigits(value);
+      column_ += len;
+      return len;
+    }
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    char *p = end;
+    do {
+      *--p = static_cast<char>('0' + value % 10);
+      value /= 10;
+    } while (value != 0);
+    Emit(p, end - p);
+    return end - p;
+  }
+
+  // Moves on to the next line, started by the branches of the ancestors.
+  void NewLine() {
+    out_->Put('\n');
+    column_ = 0;
+    Emit(prefix_);
+    Emit("--", 2);
+  }
+
+  static std::size_t NumDigits(os_int value) {
+    std::size_t digits = 1;
+    for (; value >= 10; value /= 10) {
+      digits++;
+    }
+    return digits;
+  }
+
+  // Writes the label of |view| and returns its width in bytes. Past the width
+  // of the line the width is all there is to it.
+  std::size_t WriteLabel(NodeView view) {
+    const TreeNode &node = *view;
+    std::size_t width = node.Name().size();
+    if (Clipped()) {
+      width += (node.is_thread ? 2 : 0);
+      if constexpr ((kColumns & kColumnPid) != 0) {
+        if (node.pid != kGroupRootPid) {
+          width += NumDigits(node.pid) + 2;
+        }
+      }
+      if constexpr ((kColumns & kColumnArgs) != 0) {
+        if (!node.Args().empty()) {
+          width += 1 + node.Args().size();
+        }
+      }
+      column_ += width;
+      if constexpr ((kColumns & kColumnResources) != 0) {
+        if (!node.is_thread) {
+          width += WriteResources(view);
+        }
+      }
+      return width;
+    }
+    if (node.is_thread) {
+      Emit('{');
+      Emit(node.Name());
+      Emit('}');
+      width += 2;
+    } else {
+      Emit(node.Name());
+    }
+    if constexpr ((kColumns & kColumnPid) != 0) {
+      if (node.pid != kGroupRootPid) {
+        Emit('(');
+        width += EmitInt(node.pid) + 2;
+        Emit(')');
+      }
+    }
+    if constexpr ((kColumns & kColumnResources) != 0) {
+      if (!node.is_thread) {
+        width += WriteResources(view);
+      }
+    }
+    if constexpr ((kColumns & kColumnArgs) != 0) {
+      if (!node.Args().empty()) {
+        Emit(' ');
+        Emit(node.Args());
+        width += 1 + node.Args().size();
+      }
+    }
+    return width;
+  }
+
+  // Writes "[rss cpu%]" of a process, followed by " / rss cpu%" of its
+  // subtree if it has child processes, and returns its width.
+  std::size_t WriteResources(NodeView node) {
+    std::size_t width = 2;
+    Emit('[');
+    width += WriteUsage(node->rss_kb, node->cpu);
+    for (NodeView child : node.Children()) {
+      if (!child->IsThread()) {
+        const ResourceTotal &total = (*totals_)[node.Index()];
+        Emit(" / ", 3);
+        width += 3 + WriteUsage(total.rss_kb, node->cpu < 0 ? -1 : total.cpu);
+        break;
+      }
+    }
+    Emit(']');
+    return width;
+  }
+
+  // Writes |rss_kb| as 512K, 4.1M or 41M and |cpu| as 0.5%, unless unknown.
+  std::size_t WriteUsage(os_int rss_kb, float cpu) {
+    static const char kUnits[] = "KMGT";
+    char buf[48];
+    int len = 1;
+    buf[0] = '-';
+    if (rss_kb >= 0) {
+      double size = static_cast<double>(rss_kb);
+      int unit = 0;
+      while (size >= 1024 && unit < 3) {
+        size /= 1024;
+        unit++;
+      }
+      len = snprintf(buf, sizeof(buf), (unit > 0 && size < 10) ? "%.1f%c"
+                                                                 : "%.0f%c",
+                     size, kUnits[unit]);
+    }
+    if (cpu >= 0) {
+      len += snprintf(buf + len, sizeof(buf) - len, " %.1f%%", cpu);
+    }
+    Emit(buf, len);
+    return len;
+  }
+
+  // Writes the threads of |node| but its main one as {name} or N*[{name}].
+  void WriteThreadGroup(const TreeNode &node) {
+    if (Clipped()) {
+      return;
+    }
+    os_int count = node.num_threads - 1;
+    if (count > 1) {
+      EmitInt(count);
+      Emit("*[{", 3);
+      Emit(node.Name());
+      Emit("}]", 2);
+    } else {
+      Emit('{');
+      Emit(node.Name());
+      Emit('}');
+    }
+  }
+
+  // The thread group goes first, where expanded threads would be.
+  std::uint32_t NumThreadGroups(NodeView node) const {
+    return (compact_threads_ && !node->IsThread() && node->num_threads > 1)
+               ? 1
+               : 0;
+  }
+
+  std::uint32_t NumChildren(NodeView node) const {
+    return NumThreadGroups(node) +
+           (folder_ != nullptr ? folder_->NumGroups(node.Index())
+                               : node.Children().size());
+  }
+
+  // Draws the label of |count| identical copies of the subtree |node|,
+  // |depth| levels below the root, as one, and pushes the level of its
+  // children unless there are none to draw.
+  void EnterNode(NodeView node, std::size_t start_pos, std::uint32_t count,
+                 std::size_t depth) {
+    std::size_t width = 0;
+    if (count > 1) {
+      width += EmitInt(count) + 2;
+      Emit("*[", 2);
+    }
+    width += WriteLabel(node);
+    std::uint32_t num_children =
+        (depth < limits_.max_depth ? NumChildren(node) : 0);
+    if (num_children == 0) {
+      if (count > 1) {
+        Emit(']');
+      }
+      return;
+    }
+    WalkFrame frame{node};
+    frame.count = count;
+    frame.depth = depth;
+    // prefix_ always ends at the column of the innermost branch, which on
+    // lines of their own is two columns into the label.
+    frame.branch_pos = start_pos + (kOwnLines ? 0 : width) + 3;
+    frame.prefix_len = prefix_.size();
+    prefix_.append(frame.branch_pos - frame.prefix_len - 1, ' ');
+    prefix_.push_back('|');
+    if constexpr (!kOwnLines) {
+      Emit(num_children > 1 ? "--+--" : "-----", 5);
+    }
+    stack_->push_back(frame);
+  }
+
+  OutputBuffer *out_;
+  bool compact_threads_;
+  const SubtreeFolder *folder_;
+  const std::vector<ResourceTotal> *totals_;
+  const RenderLimits limits_;
+  WalkStack own_stack_;
+  WalkStack *const stack_;
+  std::string prefix_;
+  // Columns of the current line so far, only counted with a width.
+  std::size_t column_ = 0;
+};
+
+// The --format=binary snapshot, in host byte order:
+//
+//   SnapshotHeader | SnapshotRecord[num_records] | string table
+//
+// Records are in breadth first order from the roots, which come first, so the
+// children of a record are the records [first_child, first_child +
+// num_children) and the roots are [0, first_child of record 0). A name is the
+// name_size bytes at name_offset of the string table. Every part
+// stays 4 byte aligned, a consumer can mmap() the file and use it in place.
+struct SnapshotHeader {
+  char magic[4];
+  std::uint16_t version;
+  std::uint16_t record_size;
+  std::uint32_t num_records;
+  std::uint32_t strings_size;
+};
+
+struct SnapshotRecord {
+  std::int32_t pid;
+  std::int32_t tgid;
+  std::int32_t ppid;
+  std::int32_t num_threads;
+  std::uint32_t name_offset;
+  std::uint32_t name_size;
+  std::uint32_t first_child;
+  std::uint32_t num_children;
+};
+
+static_assert(sizeof(SnapshotHeader) == 16, "SnapshotHeader is 16 bytes");
+static_assert(sizeof(SnapshotRecord) == 32, "SnapshotRecord is 32 bytes");
+
+constexpr char kSnapshotMagic[4] = {'P', 'S', 'T', 'R'};
+constexpr std::uint16_t kSnapshotVersion = 1;
+
+// The --cache file, a snapshot of every task of a tree for a later run to
+// start from:
+//
+//   CacheHeader | CacheRecord[num_records] | string table
+//
+// laid out like --format=binary, with what telling a task apart and drawing
+// it needs on top. Records are in node order, linked by ppid and tgid, and
+// leave first_child and num_children 0. A cache only holds for the procfs
+// directory, boot and parser fields it was written with.
+struct CacheHeader {
+  SnapshotHeader snapshot;
+  // The ProcField set of PsTree::Fields(), the ThreadMode above it.
+  std::uint32_t fields;
+  // The cap of the arguments, see PsTree::SetArgs().
+  std::uint32_t args_size;
+  std::uint64_t proc_dev;
+  std::uint64_t proc_ino;
+  // /proc/sys/kernel/random/boot_id, empty if there is none.
+  char boot_id[40];
+};
+
+struct CacheRecord {
+  SnapshotRecord node;
+  std::int64_t start_ticks;
+  // Of the /proc/<pid> directory in the listing, 0 for a thread.
+  std::uint64_t dir_ino;
+  // kNoCacheArgs unless the arguments were fetched.
+  std::uint32_t args_offset;
+  std::uint32_t args_size;
+  std::int32_t uid;
+  std::int32_t ns_level;
+};
+
+static_assert(sizeof(CacheHeader) == 80, "CacheHeader is 80 bytes");
+static_assert(sizeof(CacheRecord) == 64, "CacheRecord is 64 bytes");
+
+constexpr char kCacheMagic[4] = {'P', 'S', 'T', 'C'};
+constexpr std::uint16_t kCacheVersion = 1;
+constexpr std::uint32_t kNoCacheArgs = UINT32_MAX;
+
+// A read only private mapping of a whole file, unmapped on destruction.
+class MappedFile {
+ public:
+  // Data() is nullptr when |path| cannot be mapped.
+  explicit MappedFile(const std::string &path) {
+    ScopedFd fd(open(path.c_str(), O_RDONLY | O_CLOEXEC));
+    struct stat st;
+    PSTREE_COUNT(kSyscalls, 3);
+    if (fd.Get() < 0 || fstat(fd.Get(), &st) != 0 || st.st_size <= 0) {
+      return;
+    }
+    void *data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd.Get(), 0);
+    if (data != MAP_FAILED) {
+      data_ = static_cast<const char *>(data);
+      size_ = st.st_size;
+    }
+  }
+
+  ~MappedFile() {
+    if (data_ != nullptr) {
+      munmap(const_cast<char *>(data_), size_);
+    }
+  }
+
+  MappedFile(const MappedFile &) = delete;
+  MappedFile &operator=(const MappedFile &) = delete;
+
+  const char *Data() const { return data_; }
+  std::size_t Size() const { return size_; }
+
+ private:
+  const char *data_ = nullptr;
+  std::size_t size_ = 0;
+};
+
+class PsTree {
+ public:
+  // |proc_fd| is an open /proc directory, |proc_path| its path for messages.
+  PsTree(int proc_fd, const std::string &proc_path,
+         ProcFormat format = ProcFormat::kStatus)
+      : proc_fd_(proc_fd),
+        proc_path_(proc_path),
+        format_(format),
+        parse_(SelectProcParser(format, 0)) {
+    walk_.reserve(kWalkStackReserve);
+  }
+
+  // Nodes are plain values in nodes_, so tearing the tree down frees a couple
+  // of arrays instead of walking it.
+  ~PsTree() = default;
+
+  NodeIndex CreateTreeNode(NamePool::Id name, os_int pid, os_int tgid,
+                           os_int ppid, os_int threads) {
+    PSTREE_COUNT(kNodesCreated, 1);
+    NodeIndex index = static_cast<NodeIndex>(nodes_.size());
+    nodes_.emplace_back(name, pid, tgid, ppid, threads);
+    if (pid == root_pid_) {
+      root_ = index;
+    }
+    return index;
+  }
+
+  NodeIndex CreateTreeNode(std::string_view name, os_int pid, os_int tgid,
+                           os_int ppid, os_int threads) {
+    return CreateTreeNode(NamePool::Get().Intern(name), pid, tgid, ppid,
+                          threads);
+  }
+
+  NodeIndex CreateTreeNode(const TaskRecord &record) {
+    NodeIndex index = CreateTreeNode(record.name, record.pid, record.tgid,
+                                     record.ppid, record.threads);
+    nodes_[index].uid = record.uid;
+    nodes_[index].ns_level = record.ns_level;
+    nodes_[index].start_ticks = record.start_ticks;
+    if (resources_) {
+      SampleResources(record, false, &nodes_[index]);
+    }
+    return index;
+  }
+
+  NodeView View(NodeIndex index) const {
+    return NodeView(nodes_.data(), child_index_.data(), index);
+  }
+
+  NodeView RootNode() const { return View(root_); }
+
+  // Nodes, the virtual kernal node and removed ones included.
+  std::size_t NumNodes() const { return nodes_.size(); }
+
+  // Tasks of the tree, the threads of a process counted whether they have
+  // nodes or not.
+  std::size_t NumTasks() const {
+    std::size_t tasks = 0;
+    for (const TreeNode &node : nodes_) {
+      if (node.alive && !node.IsThread() && node.pid > 0) {
+        tasks += std::max<os_int>(node.num_threads, 1);
+      }
+    }
+    return tasks;
+  }
+
+  // Records |child| under |parent|. The child ranges are only rebuilt by
+  // LinkChildren(), views taken in between still show the old shape.
+  void InsertChild(NodeIndex parent, NodeIndex child) {
+    assert(parent < nodes_.size() && child < nodes_.size());
+    nodes_[child].parent = parent;
+  }
+
+  // Lays out every node's children contiguously in child_index_, in node
+  // creation order, with one counting pass over the parent indices. Threads
+  // of a removed process go with it, and its child processes stay out of the
+  // tree until they are reparented; TakeOrphans() returns them.
+  void LinkChildren() {
+    for (TreeNode &node : nodes_) {
+      node.num_children = 0;
+    }
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      TreeNode &node = nodes_[index];
+      if (node.parent != kNoNode && !nodes_[node.parent].alive) {
+        if (node.IsThread()) {
+          RemoveNode(index);
+        } else {
+          node.parent = kNoNode;
+          orphans_.push_back(index);
+        }
+      }
+      if (node.parent != kNoNode) {
+        nodes_[node.parent].num_children++;
+      }
+    }
+    std::uint32_t offset = 0;
+    for (TreeNode &node : nodes_) {
+      node.first_child = offset;
+      offset += node.num_children;
+      node.num_children = 0;
+    }
+    child_index_.resize(offset);
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      NodeIndex parent = nodes_[index].parent;
+      if (parent != kNoNode) {
+        TreeNode &parent_node = nodes_[parent];
+        child_index_[parent_node.first_child + parent_node.num_children++] =
+            index;
+      }
+    }
+  }
+
+  // Operations for a tree that follows the system as it changes. They only
+  // update parent links; LinkChildren() lays the children out again before
+  // the tree is rendered.
+
+  // Adds a task, or returns the node that already exists for |pid|.
+  NodeIndex AddTask(std::string_view name, os_int pid, os_int tgid,
+                    os_int ppid, os_int threads) {
+    NodeIndex index = nodes_map_.Find(pid);
+    if (index != kNoNode) {
+      return index;
+    }
+    if (pid != tgid && thread_mode_ != ThreadMode::kExpand) {
+      // Only counted, a thread gets no node of its own.
+      index = nodes_map_.Find(tgid);
+      if (index != kNoNode) {
+        nodes_[index].num_threads++;
+        nodes_[index].has_threads = true;
+      }
+      return index;
+    }
+    index = CreateTreeNode(name, pid, tgid, ppid, threads);
+    nodes_map_.Set(pid, index);
+    TreeNode &node = nodes_[index];
+    if (!node.IsRoot()) {
+      NodeIndex parent = nodes_map_.Find(node.IsThread() ? tgid : ppid);
+      node.parent = (parent == index ? kNoNode : parent);
+      if (parent != kNoNode) {
+        // Unless it was cloned into a new one, which there is no telling
+        // without its status.
+        node.ns_level = nodes_[parent].ns_level;
+      }
+      if (node.IsThread() && parent != kNoNode) {
+        nodes_[parent].has_threads = true;
+      }
+    }
+    return index;
+  }
+
+  // Removes a task of the process |tgid|. The threads of a process are
+  // removed with it and its children are reported by TakeOrphans() after the
+  // next LinkChildren().
+  void RemoveTask(os_int pid, os_int tgid) {
+    if (pid != tgid && thread_mode_ != ThreadMode::kExpand) {
+      NodeIndex index = nodes_map_.Find(tgid);
+      if (index != kNoNode && nodes_[index].num_threads > 1) {
+        nodes_[index].has_threads = (--nodes_[index].num_threads > 1);
+      }
+      return;
+    }
+    NodeIndex index = nodes_map_.Find(pid);
+    if (index != kNoNode) {
+      RemoveNode(index);
+    }
+  }
+
+  // Moves the process |pid| under |ppid|.
+  void ReparentTask(os_int pid, os_int ppid) {
+    NodeIndex index = nodes_map_.Find(pid);
+    if (index == kNoNode || nodes_[index].IsRoot()) {
+      return;
+    }
+    NodeIndex parent = nodes_map_.Find(ppid);
+    nodes_[index].ppid = ppid;
+    nodes_[index].parent = (parent == index ? kNoNode : parent);
+  }
+
+  // Renames the process |pid| and its threads, which carry its name. Its
+  // arguments are read again by the next FetchArgs().
+  void RenameTask(os_int pid, std::string_view name) {
+    NodeIndex index = nodes_map_.Find(pid);
+    if (index == kNoNode) {
+      return;
+    }
+    NamePool::Id id = NamePool::Get().Intern(name);
+    nodes_[index].name = id;
+    nodes_[index].args = NamePool::kNoId;
+    for (NodeView child : View(index).Children()) {
+      if (child->IsThread()) {
+        nodes_[child.Index()].name = id;
+      }
+    }
+  }
+
+  // Sets the thread count of the process |pid|, drawn in kCompact mode.
+  void SetTaskThreads(os_int pid, os_int threads) {
+    NodeIndex index = nodes_map_.Find(pid);
+    if (index == kNoNode) {
+      return;
+    }
+    nodes_[index].num_threads = threads;
+    nodes_[index].has_threads = (threads > 1);
+  }
+
+  NodeView FindTask(os_int pid) const { return View(nodes_map_.Find(pid)); }
+
+  // Live processes whose parent was removed, as found by LinkChildren().
+  std::vector<NodeIndex> TakeOrphans() {
+    std::vector<NodeIndex> orphans;
+    orphans.swap(orphans_);
+    return orphans;
+  }
+
+  // Compacts the node array once removed nodes make up half of it.
+  void MaybeCompact() {
+    if (num_dead_ > nodes_.size() / 2) {
+      Compact();
+    }
+  }
+
+  // Parses the status (or stat) file of task |pid| listed in |dir_fd|, |tgid|
+  // is only needed for the stat format where it cannot be read from the file.
+  // A task of another user than |uid_filter| is only parsed up to its Uid.
+  bool ParseTask(int dir_fd, os_int pid, const std::string &proc_name,
+                 os_int tgid, TaskRecord *record,
+                 os_int uid_filter = -1) const {
+    char buf[kProcFileBufSize];
+    std::string overflow;
+    ProcStatus status;
+    if (!ReadProcStatus(dir_fd, pid, format_, parse_, tgid, buf, sizeof(buf),
+                        &overflow, &status, uid_filter)) {
+      return false;
+    }
+    ToTaskRecord(status, record);
+    if (!proc_name.empty()) {
+      record->name = proc_name;
+    }
+    return true;
+  }
+
+  // Parses the process |pid| from the /proc directory.
+  bool ParseTask(os_int pid, TaskRecord *record) const {
+    return ParseTask(proc_fd_, pid, "", -1, record);
+  }
+
+  NodeIndex CreateTreeNode(int dir_fd, os_int pid, const std::string &proc_name,
+                           os_int tgid = -1) {
+    TaskRecord record;
+    if (!ParseTask(dir_fd, pid, proc_name, tgid, &record)) {
+      std::cerr << "Couldn't open file: " << TaskFilePath(pid, tgid)
+                << std::endl;
+      return kNoNode;
+    }
+    return CreateTreeNode(record);
+  }
+
+  // Spreads the per process parse jobs, thread enumeration included, over
+  // |pool|. Workers only append to their own record buffer; the buffers are
+  // merged back in |pids| order so the nodes come out exactly as a serial
+  // scan creates them.
+  void SetWorkerPool(WorkStealingPool *pool) { pool_ = pool; }
+
+  // Reads the status files of the processes in a scan through an io_uring
+  // per worker (see UringReader) instead of three syscalls each. Threads are
+  // still read synchronously. Returns false with the reason in |error|, and
+  // the synchronous path kept, when io_uring is not available.
+  bool UseUring(std::string *error) {
+    std::unique_ptr<UringReader> ring = UringReader::Create(error);
+    if (ring == nullptr) {
+      return false;
+    }
+    rings_.clear();
+    rings_.push_back(std::move(ring));
+    return true;
+  }
+
+  // The tree is drawn from |pid| instead of init. Set before building.
+  void SetRootPid(os_int pid) { root_pid_ = pid; }
+
+  // Whether the tree has the task of the root pid.
+  bool HasRoot() const { return root_ != kNoNode; }
+
+  // Only the processes of |uid| are drawn, each that has a parent of another
+  // user as the root of its own tree, and the tasks of other users are only
+  // parsed up to their Uid: line. Set before building.
+  void SetUidFilter(os_int uid) {
+    uid_filter_ = uid;
+    SelectParser();
+  }
+
+  // Reads the pid namespace of every task with its status, for GroupTasks().
+  // Stat files have none, so set before building a tree of status files.
+  void SetGroupMode(GroupMode mode) {
+    group_mode_ = mode;
+    SelectParser();
+  }
+
+  // Keeps the start time of every task, with the stat format, for
+  // SaveCache(). Set before building.
+  void SetStartTimes(bool start_times) {
+    start_times_ = start_times;
+    SelectParser();
+  }
+
+  // Moves every process that runs in a deeper pid namespace than its parent,
+  // the first one of a container, with its subtree under the synthetic root
+  // of its group, which Roots() draws beside the tree like the kernal node:
+  // one per pid namespace, or with GroupMode::kCgroup one per cgroup of those
+  // first processes. Only first processes are looked up, once in the life of
+  // their node, so a namespace costs a syscall or two however many tasks are
+  // in it. Call after every build or update.
+  void GroupTasks() {
+    if (group_mode_ == GroupMode::kNone) {
+      return;
+    }
+    bool moved = false;
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      const TreeNode &node = nodes_[index];
+      if (!node.alive || node.IsThread() || node.parent == kNoNode ||
+          node.ns_level <= nodes_[node.parent].ns_level) {
+        continue;
+      }
+      if (node.group == NamePool::kNoId) {
+        nodes_[index].group = LookupGroup(node.pid);
+        if (nodes_[index].group == NamePool::kNoId) {
+          continue;
+        }
+      }
+      // Making the group root may move nodes_.
+      NodeIndex root = GroupRoot(nodes_[index].group, nodes_[index].ns_level);
+      nodes_[index].parent = root;
+      moved = true;
+    }
+    if (moved) {
+      LinkChildren();
+    }
+  }
+
+  // Picks how threads are shown. A tree that was built without thread nodes
+  // reads the task/ directories only once they are asked for, and a tree that
+  // had them drops them.
+  void SetThreadMode(ThreadMode mode) {
+    if (mode == thread_mode_) {
+      return;
+    }
+    thread_mode_ = mode;
+    if (nodes_.empty()) {
+      return;
+    }
+    if (mode == ThreadMode::kExpand) {
+      ExpandThreads();
+      return;
+    }
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      if (nodes_[index].alive && nodes_[index].IsThread()) {
+        RemoveNode(index);
+      }
+    }
+    MaybeCompact();
+    LinkChildren();
+  }
+
+  // |pids| are parsed into nodes, followed by the virtual kernal node if
+  // |add_kernal|.
+  bool CreateTreeNodes(const std::vector<os_int> &pids,
+                       bool add_kernal = true) {
+    PSTREE_PHASE(kCreateTreeNodes);
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<std::vector<TaskRecord>> buffers(pool.Size());
+    std::vector<ProcJob> results(pids.size());
+    ParseProcs(pids, pool, &buffers, &results);
+    std::size_t num_records = 1;
+    for (const std::vector<TaskRecord> &records : buffers) {
+      num_records += records.size();
+    }
+    nodes_.reserve(nodes_.size() + num_records);
+
+    // Tasks that could not be read are left out, the rest of the snapshot
+    // is still good.
+    bool complete = true;
+    for (std::size_t job = 0; job < pids.size(); job++) {
+      const ProcJob &result = results[job];
+      const std::vector<TaskRecord> &records = buffers[result.worker];
+      for (std::size_t i = result.begin; i < result.end; i++) {
+        CreateTreeNode(records[i]);
+      }
+      if (result.failed_pid >= 0) {
+        std::cerr << "Couldn't open file: "
+                  << TaskFilePath(result.failed_pid, result.failed_tgid)
+                  << std::endl;
+        complete = false;
+      }
+    }
+    if (add_kernal) {
+      // Create virtual kernal node.
+      std::string virtual_root("kernal");
+      CreateTreeNode(virtual_root, 0, 0, 0, 1);
+    }
+    return complete;
+  }
+
+  // Where the records of one process job went.
+  struct ProcJob {
+    std::size_t worker = 0;
+    std::size_t begin = 0;
+    std::size_t end = 0;
+    // The first task whose file could not be read for another reason than
+    // the task having exited, -1 if there is none.
+    os_int failed_pid = -1;
+    os_int failed_tgid = -1;
+  };
+
+  // Parses the processes |pids| over |pool| into the |buffers| of its
+  // workers, with one job per process, or with UseUring() one per batch of
+  // kUringBatch processes whose status files a worker's ring reads.
+  void ParseProcs(const std::vector<os_int> &pids, WorkStealingPool &pool,
+                  std::vector<std::vector<TaskRecord>> *buffers,
+                  std::vector<ProcJob> *results) {
+    if (rings_.empty()) {
+      pool.ParallelFor(pids.size(), [&](std::size_t job, std::size_t worker) {
+        ParseProc(pids[job], &(*buffers)[worker], &(*results)[job]);
+        (*results)[job].worker = worker;
+      });
+      return;
+    }
+    rings_.resize(std::max(rings_.size(), pool.Size()));
+    std::size_t num_batches = (pids.size() + kUringBatch - 1) / kUringBatch;
+    pool.ParallelFor(num_batches, [&](std::size_t batch, std::size_t worker) {
+      std::size_t begin = batch * kUringBatch;
+      std::size_t end = std::min(pids.size(), begin + kUringBatch);
+      std::vector<TaskRecord> read(end - begin);
+      std::vector<int> errors(end - begin, -1);
+      std::unique_ptr<UringReader> &ring = rings_[worker];
+      if (ring == nullptr) {
+        std::string error;
+        ring = UringReader::Create(&error);
+      }
+      if (ring != nullptr) {
+        ring->ReadTasks(proc_fd_, pids.data() + begin, end - begin, format_,
+                        parse_, uid_filter_, read.data(), errors.data());
+      }
+      std::vector<TaskRecord> *records = &(*buffers)[worker];
+      for (std::size_t i = 0; i < end - begin; i++) {
+        ProcJob *result = &(*results)[begin + i];
+        result->worker = worker;
+        if (errors[i] > 0) {
+          result->begin = result->end = records->size();
+          if (!IsVanished(errors[i])) {
+            result->failed_pid = pids[begin + i];
+          }
+          continue;
+        }
+        ParseProc(pids[begin + i], records, result, nullptr,
+                  errors[i] == 0 ? &read[i] : nullptr);
+      }
+    });
+  }
+
+  // Parses one process and, if it has any, its threads into |records|. Tasks
+  // that exit meanwhile are skipped.
+  // With |children| it also collects the child processes of all its threads.
+  // |status| is the process's already parsed status file, if any.
+  void ParseProc(os_int pid, std::vector<TaskRecord> *records,
+                 ProcJob *result, std::vector<os_int> *children = nullptr,
+                 const TaskRecord *status = nullptr) const {
+    result->begin = records->size();
+    result->end = records->size();
+    TaskRecord record;
+    if (status != nullptr) {
+      record = *status;
+    } else if (!ParseTask(proc_fd_, pid, "", -1, &record, uid_filter_)) {
+      if (!IsVanished(errno)) {
+        result->failed_pid = pid;
+      }
+      return;
+    }
+    records->push_back(record);
+    result->end = records->size();
+    bool threaded = (record.pid == record.tgid && record.threads > 1);
+    if (!threaded) {
+      if (children != nullptr) {
+        char path[64];
+        ReadChildren(proc_fd_, ChildrenPath(pid, pid, path), children);
+      }
+      return;
+    }
+    if (thread_mode_ != ThreadMode::kExpand && children == nullptr) {
+      return;
+    }
+    std::vector<os_int> tids;
+    ScopedFd task_fd(OpenTaskDir(pid));
+    ReadProcs(task_fd.Get(), pid, &tids);
+    if (children != nullptr) {
+      char path[64];
+      ReadChildren(task_fd.Get(), TaskPath(pid, "children", path), children);
+      for (os_int tid : tids) {
+        ReadChildren(task_fd.Get(), TaskPath(tid, "children", path),
+                     children);
+      }
+    }
+    if (thread_mode_ != ThreadMode::kExpand) {
+      return;
+    }
+    for (os_int tid : tids) {
+      TaskRecord thread_record;
+      if (!ParseTask(task_fd.Get(), tid, record.name, record.pid,
+                     &thread_record)) {
+        if (!IsVanished(errno) && result->failed_pid < 0) {
+          result->failed_pid = tid;
+          result->failed_tgid = pid;
+        }
+        continue;
+      }
+      records->push_back(thread_record);
+      result->end = records->size();
+    }
+  }
+
+  // Formats "<pid>/task/<tid>/children" into |buf|.
+  static const char *ChildrenPath(os_int pid, os_int tid, char (&buf)[64]) {
+    char tail[64];
+    TaskPath(tid, "children", tail);
+    TaskPath(pid, "task/", buf);
+    std::size_t len = strlen(buf);
+    assert(len + strlen(tail) < sizeof(buf));
+    memcpy(buf + len, tail, strlen(tail) + 1);
+    return buf;
+  }
+
+  // Appends the pids of a children file, "<pid> <pid> ", to |children|.
+  // Returns false if the file cannot be read.
+  static bool ReadChildren(int dir_fd, const char *path,
+                           std::vector<os_int> *children) {
+    ScopedFd fd(openat(dir_fd, path, O_RDONLY | O_CLOEXEC));
+    PSTREE_COUNT(kSyscalls, 1);
+    if (fd.Get() < 0) {
+      return false;
+    }
+    char buf[kProcFileBufSize];
+    std::string pending;
+    for (;;) {
+      ssize_t n = read(fd.Get(), buf, sizeof(buf));
+      PSTREE_COUNT(kSyscalls, 1);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      PSTREE_COUNT(kBytesRead, n);
+      // A pid may straddle two reads, keep the tail for the next one.
+      pending.append(buf, n);
+      const char *p = pending.data();
+      const char *end = p + pending.size();
+      const char *last_space = end;
+      while (last_space > p && *(last_space - 1) != ' ') {
+        last_space--;
+      }
+      while (p < last_space) {
+        os_int pid;
+        const char *next = DecodeInt(p, last_space, &pid);
+        if (next == nullptr) {
+          p++;
+          continue;
+        }
+        children->push_back(pid);
+        p = next;
+      }
+      pending.erase(0, last_space - pending.data());
+    }
+    os_int pid;
+    if (DecodeInt(pending.data(), pending.data() + pending.size(), &pid)) {
+      children->push_back(pid);
+    }
+    return true;
+  }
+
+  // Opens /proc/<pid>/task, or returns -1.
+  int OpenTaskDir(os_int pid) const {
+    char path[64];
+    PSTREE_COUNT(kSyscalls, 1);
+    return openat(proc_fd_, TaskPath(pid, "task", path),
+                  O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  }
+
+  // The path of a task file, for messages: /proc/<pid>/status, or
+  // /proc/<tgid>/task/<pid>/status for a thread.
+  std::string TaskFilePath(os_int pid, os_int tgid) const {
+    std::string path = proc_path_ + "/";
+    if (tgid > 0 && tgid != pid) {
+      path += std::to_string(tgid) + "/task/";
+    }
+    return path + std::to_string(pid) + "/" + ProcFileName(format_);
+  }
+
+  bool BuildTreeNodeMap() {
+    PSTREE_PHASE(kBuildTreeNodeMap);
+    if (nodes_.empty()) {
+      std::cerr << "Empty tree node list." << std::endl;
+      return false;
+    }
+
+    nodes_map_.Reserve(ReadPidMax());
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      nodes_map_.Set(nodes_[index].pid, index);
+    }
+    return true;
+  }
+
+  void BuildTree(const std::vector<os_int> &pids) {
+    PSTREE_PHASE(kBuildTree);
+    if (pids.empty()) {
+      std::cerr << "Empty process files." << std::endl;
+      return;
+    }
+    CreateTreeNodes(pids);
+    LinkTree();
+  }
+
+  // Builds the tree from tasks enumerated by something other than /proc,
+  // ordered like a /proc scan: every process followed by its threads. The
+  // processes of |pids|, a ReadProcs() listing, that |records| lacks are
+  // parsed from /proc and built in their place.
+  void BuildTree(const std::vector<TaskRecord> &records,
+                 const std::vector<os_int> &pids) {
+    PSTREE_PHASE(kBuildTree);
+    if (records.empty()) {
+      std::cerr << "Empty task list." << std::endl;
+      return;
+    }
+    std::unordered_set<os_int> reported;
+    for (const TaskRecord &record : records) {
+      reported.insert(record.tgid);
+    }
+    std::vector<os_int> missing;
+    for (os_int pid : pids) {
+      if (reported.count(pid) == 0) {
+        missing.push_back(pid);
+      }
+    }
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<std::vector<TaskRecord>> buffers(pool.Size());
+    std::vector<ProcJob> results(missing.size());
+    ParseProcs(missing, pool, &buffers, &results);
+
+    nodes_.reserve(nodes_.size() + records.size() + 1);
+    auto create = [&](const TaskRecord &record) {
+      if (record.pid != record.tgid && thread_mode_ != ThreadMode::kExpand) {
+        return;
+      }
+      CreateTreeNode(record);
+    };
+    // Both are in tgid order, merge them.
+    std::size_t next = 0;
+    for (std::size_t job = 0; job < missing.size(); job++) {
+      for (; next < records.size() && records[next].tgid < missing[job];
+           next++) {
+        create(records[next]);
+      }
+      const std::vector<TaskRecord> &parsed = buffers[results[job].worker];
+      for (std::size_t i = results[job].begin; i < results[job].end; i++) {
+        create(parsed[i]);
+      }
+    }
+    for (; next < records.size(); next++) {
+      create(records[next]);
+    }
+    // Create virtual kernal node.
+    std::string virtual_root("kernal");
+    CreateTreeNode(virtual_root, 0, 0, 0, 1);
+    LinkTree();
+  }
+
+  // Builds only the subtree of the root pid (see SetRootPid()) with
+  // BuildTopDown(), so no other task is read. Returns false, with nothing
+  // built, if the root is gone or the kernel has no children files
+  // (CONFIG_PROC_CHILDREN).
+  bool BuildSubtree() {
+    PSTREE_PHASE(kBuildTree);
+    if (!HasChildrenFiles(root_pid_)) {
+      return false;
+    }
+    BuildTopDown(std::vector<os_int>(1, root_pid_));
+    if (nodes_.empty()) {
+      return false;
+    }
+    // Create virtual kernal node.
+    std::string virtual_root("kernal");
+    nodes_map_.Set(0, CreateTreeNode(virtual_root, 0, 0, 0, 1));
+    LinkChildren();
+    return true;
+  }
+
+  // Builds the whole tree with BuildTopDown() from init and kthreadd, which
+  // hold every task of the system, instead of linking a scan by ppid.
+  // Processes no children file led to are then added from a listing of
+  // /proc: ones forked meanwhile, and the ones whose parent is outside of the
+  // pid namespace (ppid 0). Returns false, with nothing built, without
+  // children files.
+  bool BuildTreeTopDown() {
+    PSTREE_PHASE(kBuildTree);
+    if (!HasChildrenFiles(1)) {
+      return false;
+    }
+    std::vector<os_int> seeds = {1, 2};
+    BuildTopDown(seeds);
+    // Create virtual kernal node.
+    std::string virtual_root("kernal");
+    NodeIndex kernal = CreateTreeNode(virtual_root, 0, 0, 0, 1);
+    nodes_map_.Set(0, kernal);
+    // The seeds other than init hang from their ppid, the kernal unless
+    // kthreadd is an ordinary process (pid 2 in a container).
+    for (NodeIndex index = 0; index < kernal; index++) {
+      TreeNode &node = nodes_[index];
+      if (node.parent == kNoNode && !node.IsRoot()) {
+        NodeIndex parent = nodes_map_.Find(node.ppid);
+        node.parent = (parent != kNoNode && parent != index) ? parent : kernal;
+      }
+    }
+    std::vector<os_int> pids;
+    ReadProcs(proc_fd_, -1, &pids);
+    std::vector<os_int> missing;
+    for (os_int pid : pids) {
+      if (nodes_map_.Find(pid) == kNoNode) {
+        missing.push_back(pid);
+      }
+    }
+    if (!missing.empty()) {
+      std::size_t first = nodes_.size();
+      CreateTreeNodes(missing, false);
+      for (NodeIndex index = first; index < nodes_.size(); index++) {
+        nodes_map_.Set(nodes_[index].pid, index);
+      }
+      for (NodeIndex index = first; index < nodes_.size(); index++) {
+        TreeNode &node = nodes_[index];
+        NodeIndex parent =
+            nodes_map_.Find(node.IsThread() ? node.tgid : node.ppid);
+        node.parent = (parent != kNoNode && parent != index) ? parent : kernal;
+      }
+    }
+    LinkChildren();
+    return true;
+  }
+
+  // Whether the kernel lists the children of |pid| in children files.
+  bool HasChildrenFiles(os_int pid) const {
+    char path[64];
+    struct stat st;
+    PSTREE_COUNT(kSyscalls, 1);
+    return fstatat(proc_fd_, ChildrenPath(pid, pid, path), &st, 0) == 0;
+  }
+
+  // Creates the processes |seeds| and everything below them by walking down
+  // the task/<tid>/children lists, breadth first with one level of the walk
+  // parsed in parallel at a time. Every node is created linked under its
+  // parent and in nodes_map_, in the order the kernel lists the children,
+  // which is pid order unless pids wrapped around; seeds get no parent.
+  void BuildTopDown(const std::vector<os_int> &seeds) {
+    struct Pending {
+      os_int pid;
+      NodeIndex parent;
+    };
+    nodes_map_.Reserve(ReadPidMax());
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<Pending> frontier;
+    for (os_int pid : seeds) {
+      frontier.push_back({pid, kNoNode});
+    }
+    std::vector<std::vector<TaskRecord>> buffers(pool.Size());
+    std::vector<Pending> next;
+    while (!frontier.empty()) {
+      for (std::vector<TaskRecord> &records : buffers) {
+        records.clear();
+      }
+      std::vector<ProcJob> results(frontier.size());
+      std::vector<std::vector<os_int>> children(frontier.size());
+      pool.ParallelFor(frontier.size(), [&](std::size_t job,
+                                            std::size_t worker) {
+        ParseProc(frontier[job].pid, &buffers[worker], &results[job],
+                  &children[job]);
+        results[job].worker = worker;
+      });
+      next.clear();
+      for (std::size_t job = 0; job < results.size(); job++) {
+        const ProcJob &result = results[job];
+        const std::vector<TaskRecord> &records = buffers[result.worker];
+        // A process reparented during the walk can be listed twice.
+        if (result.begin == result.end ||
+            nodes_map_.Find(records[result.begin].pid) != kNoNode) {
+          continue;
+        }
+        NodeIndex proc = kNoNode;
+        for (std::size_t i = result.begin; i < result.end; i++) {
+          NodeIndex index = CreateTreeNode(records[i]);
+          nodes_map_.Set(records[i].pid, index);
+          if (proc == kNoNode) {
+            proc = index;
+            nodes_[index].parent = frontier[job].parent;
+          } else {
+            nodes_[index].parent = proc;
+          }
+        }
+        for (os_int child : children[job]) {
+          next.push_back({child, proc});
+        }
+      }
+      frontier.swap(next);
+    }
+  }
+
+  // Links every node under its parent, found by pid. Parents that exited
+  // during the scan lose nothing but themselves: their threads go with them
+  // and their children are adopted by AdoptOrphan().
+  void LinkTree() {
+    BuildTreeNodeMap();
+    std::vector<NodeIndex> orphans;
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      const TreeNode &node = nodes_[index];
+      if (node.IsRoot()) {
+        continue;
+      }
+      os_int parent_id = node.IsThread() ? node.tgid : node.ppid;
+      NodeIndex parent = nodes_map_.Find(parent_id);
+      if (parent == kNoNode) {
+        if (node.IsThread()) {
+          RemoveNode(index);
+        } else if (index != root_) {
+          orphans.push_back(index);
+        }
+        continue;
+      }
+      // The virtual kernal node is its own parent, keep it out of its
+      // children.
+      if (parent != index) {
+        InsertChild(parent, index);
+      }
+    }
+    for (NodeIndex index : orphans) {
+      AdoptOrphan(index);
+    }
+    LinkChildren();
+  }
+
+  // Links the process |index| whose parent is not in the tree. The kernel has
+  // moved it to a subreaper or init by now, so its status is re-read for the
+  // new parent; init, or else the kernal node, takes it if that fails too.
+  void AdoptOrphan(NodeIndex index) {
+    NodeIndex parent = kNoNode;
+    TaskRecord record;
+    if (ParseTask(nodes_[index].pid, &record)) {
+      nodes_[index].ppid = record.ppid;
+      parent = nodes_map_.Find(record.ppid);
+    }
+    if (parent == kNoNode || parent == index) {
+      parent = (root_ != kNoNode && root_ != index) ? root_
+                                                    : nodes_map_.Find(0);
+    }
+    if (parent != kNoNode && parent != index) {
+      InsertChild(parent, index);
+    }
+  }
+
+  // Brings a tree made by BuildTree() up to date with |pids|, a newer
+  // ReadProcs() listing of the same directory, for --watch. Only processes
+  // that appeared get their status read, and once more on the next update to
+  // catch an exec right after fork. Processes that exited are removed with
+  // their threads and their children are re-read to pick up the parent they
+  // were reparented to. Thread lists are refreshed from task/ without reading
+  // any status. With SetResources() every process is re-read for its usage.
+  void UpdateTree(const std::vector<os_int> &pids) {
+    generation_++;
+    if (resources_) {
+      SampleClock();
+    }
+    seen_.resize(nodes_.size(), 0);
+    std::vector<os_int> new_pids;
+    std::vector<NodeIndex> survivors;
+    for (os_int pid : pids) {
+      NodeIndex index = nodes_map_.Find(pid);
+      if (index == kNoNode || nodes_[index].IsThread()) {
+        new_pids.push_back(pid);
+        continue;
+      }
+      seen_[index] = generation_;
+      survivors.push_back(index);
+    }
+
+    std::vector<NodeIndex> reread;
+    for (NodeIndex index : recent_) {
+      if (nodes_[index].alive && seen_[index] == generation_) {
+        reread.push_back(index);
+        // An exec right after fork changes the command line too.
+        nodes_[index].args = NamePool::kNoId;
+      }
+    }
+    recent_.clear();
+    if (resources_) {
+      reread.insert(reread.end(), survivors.begin(), survivors.end());
+    }
+    for (NodeIndex index = 0; index < seen_.size(); index++) {
+      const TreeNode &node = nodes_[index];
+      if (!node.alive || node.IsThread() || node.pid <= 0 ||
+          seen_[index] == generation_) {
+        continue;
+      }
+      for (NodeView child : View(index).Children()) {
+        if (!child->alive) {
+          continue;
+        }
+        if (child->IsThread()) {
+          RemoveNode(child.Index());
+        } else if (seen_[child.Index()] == generation_) {
+          reread.push_back(child.Index());
+        }
+      }
+      RemoveNode(index);
+    }
+    std::sort(reread.begin(), reread.end());
+    reread.erase(std::unique(reread.begin(), reread.end()), reread.end());
+
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<NodeIndex> relink;
+    UpdateThreads(survivors, pool, &relink);
+
+    // Parse the processes that appeared, in listing order.
+    std::vector<std::vector<TaskRecord>> buffers(pool.Size());
+    std::vector<ProcJob> results(new_pids.size());
+    ParseProcs(new_pids, pool, &buffers, &results);
+    for (const ProcJob &result : results) {
+      // A process that is gone already has no records.
+      const std::vector<TaskRecord> &records = buffers[result.worker];
+      for (std::size_t i = result.begin; i < result.end; i++) {
+        const TaskRecord &record = records[i];
+        NodeIndex index = CreateTreeNode(record);
+        nodes_map_.Set(record.pid, index);
+        relink.push_back(index);
+        if (!nodes_[index].IsThread()) {
+          recent_.push_back(index);
+        }
+      }
+    }
+
+    std::vector<TaskRecord> reread_records(reread.size());
+    std::vector<char> reread_ok(reread.size(), 0);
+    pool.ParallelFor(reread.size(), [&](std::size_t job, std::size_t) {
+      reread_ok[job] = ParseTask(nodes_[reread[job]].pid, &reread_records[job]);
+    });
+    for (std::size_t job = 0; job < reread.size(); job++) {
+      if (!reread_ok[job]) {
+        continue;
+      }
+      TreeNode &node = nodes_[reread[job]];
+      node.name = NamePool::Get().Intern(reread_records[job].name);
+      node.ppid = reread_records[job].ppid;
+      node.has_threads = (reread_records[job].threads > 1);
+      node.num_threads = reread_records[job].threads;
+      node.ns_level = reread_records[job].ns_level;
+      node.start_ticks = reread_records[job].start_ticks;
+      if (resources_) {
+        SampleResources(reread_records[job], true, &node);
+      }
+      relink.push_back(reread[job]);
+    }
+
+    for (NodeIndex index : relink) {
+      TreeNode &node = nodes_[index];
+      if (!node.alive || node.IsRoot()) {
+        continue;
+      }
+      NodeIndex parent = nodes_map_.Find(node.IsThread() ? node.tgid
+                                                         : node.ppid);
+      node.parent = (parent == index ? kNoNode : parent);
+    }
+    seen_.resize(nodes_.size(), generation_);
+    MaybeCompact();
+    LinkChildren();
+    orphans_.clear();
+  }
+
+  // Diffs the task/ listing of every surviving process against its thread
+  // nodes. procfs reports 2 + the number of threads as the link count of a
+  // task/ directory, so a single threaded process costs one fstatat(), and
+  // so does any process when threads are not expanded.
+  void UpdateThreads(const std::vector<NodeIndex> &survivors,
+                     WorkStealingPool &pool, std::vector<NodeIndex> *relink) {
+    struct ThreadScan {
+      bool scanned = false;
+      std::vector<os_int> tids;
+    };
+    std::vector<ThreadScan> scans(survivors.size());
+    pool.ParallelFor(survivors.size(), [&](std::size_t job, std::size_t) {
+      const TreeNode &node = nodes_[survivors[job]];
+      char path[64];
+      struct stat st;
+      PSTREE_COUNT(kSyscalls, 1);
+      if (fstatat(proc_fd_, TaskPath(node.pid, "task", path), &st, 0) != 0) {
+        return;
+      }
+      if (thread_mode_ != ThreadMode::kExpand) {
+        nodes_[survivors[job]].num_threads = st.st_nlink - 2;
+        nodes_[survivors[job]].has_threads = (st.st_nlink > 3);
+        return;
+      }
+      if (st.st_nlink <= 3 && !node.HasThreads()) {
+        return;
+      }
+      scans[job].scanned = true;
+      ScopedFd task_fd(OpenTaskDir(node.pid));
+      ReadProcs(task_fd.Get(), node.pid, &scans[job].tids);
+    });
+    for (std::size_t job = 0; job < survivors.size(); job++) {
+      if (!scans[job].scanned) {
+        continue;
+      }
+      NodeIndex proc = survivors[job];
+      for (os_int tid : scans[job].tids) {
+        NodeIndex index = nodes_map_.Find(tid);
+        if (index != kNoNode && index < seen_.size() &&
+            nodes_[index].IsThread() && nodes_[index].tgid == nodes_[proc].pid) {
+          seen_[index] = generation_;
+          continue;
+        }
+        // A thread shares everything shown but its id with the process.
+        const TreeNode &node = nodes_[proc];
+        index = CreateTreeNode(node.name, tid, node.pid, node.ppid,
+                               scans[job].tids.size() + 1);
+        nodes_map_.Set(tid, index);
+        relink->push_back(index);
+      }
+      for (NodeView child : View(proc).Children()) {
+        if (child->alive && child->IsThread() &&
+            seen_[child.Index()] != generation_) {
+          RemoveNode(child.Index());
+        }
+      }
+      nodes_[proc].has_threads = !scans[job].tids.empty();
+      nodes_[proc].num_threads = scans[job].tids.size() + 1;
+    }
+  }
+
+  // Creates the thread nodes of every process, for a tree built without them.
+  void ExpandThreads() {
+    std::vector<NodeIndex> procs;
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      const TreeNode &node = nodes_[index];
+      if (node.alive && !node.IsThread() && node.pid > 0 &&
+          node.HasThreads()) {
+        procs.push_back(index);
+      }
+    }
+    ExpandThreads(procs);
+  }
+
+  // Creates the thread nodes of the processes |procs|.
+  void ExpandThreads(const std::vector<NodeIndex> &procs) {
+    generation_++;
+    seen_.resize(nodes_.size(), 0);
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<NodeIndex> relink;
+    UpdateThreads(procs, pool, &relink);
+    for (NodeIndex index : relink) {
+      nodes_[index].parent = nodes_map_.Find(nodes_[index].tgid);
+    }
+    seen_.resize(nodes_.size(), generation_);
+    LinkChildren();
+  }
+
+  // The nodes drawn as the roots of trees: the root followed by the groups of
+  // GroupTasks() that have processes, or with a uid filter the processes of
+  // the user below those whose parent is of another user, in tree order.
+  std::vector<NodeView> Roots() const {
+    std::vector<NodeView> roots;
+    NodeIndex top = (root_ != kNoNode ? root_ : nodes_map_.Find(0));
+    if (top == kNoNode) {
+      return roots;
+    }
+    roots.push_back(View(top));
+    for (const Group &group : groups_) {
+      if (!View(group.root).Children().empty()) {
+        roots.push_back(View(group.root));
+      }
+    }
+    if (uid_filter_ < 0) {
+      return roots;
+    }
+    std::vector<NodeView> tops;
+    tops.swap(roots);
+    Walk(tops, [&](NodeView node) {
+      if (!node->IsThread() && node->uid == uid_filter_) {
+        roots.push_back(node);
+        return false;
+      }
+      return true;
+    });
+    return roots;
+  }
+
+  // Walks the subtrees of |roots| depth first on the shared walk stack,
+  // calling |pre| on every node before its children, which are skipped when
+  // it returns false, and |post| after them. Not reentrant.
+  template <typename Pre, typename Post>
+  void Walk(const std::vector<NodeView> &roots, Pre pre, Post post) const {
+    for (NodeView root : roots) {
+      walk_.clear();
+      if (pre(root)) {
+        walk_.push_back(WalkFrame{root});
+      } else {
+        post(root);
+      }
+      while (!walk_.empty()) {
+        WalkFrame &frame = walk_.back();
+        if (frame.next < frame.node.Children().size()) {
+          NodeView child = frame.node.Children()[frame.next++];
+          if (pre(child)) {
+            walk_.push_back(WalkFrame{child});
+          } else {
+            post(child);
+          }
+          continue;
+        }
+        NodeView node = frame.node;
+        walk_.pop_back();
+        post(node);
+      }
+    }
+  }
+
+  template <typename Pre>
+  void Walk(const std::vector<NodeView> &roots, Pre pre) const {
+    Walk(roots, pre, [](NodeView) {});
+  }
+
+  // The name of the group the process |pid| heads: its pid namespace as the
+  // ns/pid link reads, pid:[4026532201], or cgroup:<path> of its cgroup v2
+  // hierarchy, or else of the first v1 one. A namespace a user may not look
+  // into is named after its first process. kNoId if |pid| is gone.
+  NamePool::Id LookupGroup(os_int pid) const {
+    char path[64];
+    char buf[kProcFileBufSize];
+    std::string name;
+    if (group_mode_ == GroupMode::kPidNamespace) {
+      PSTREE_COUNT(kSyscalls, 1);
+      ssize_t n = readlinkat(proc_fd_, TaskPath(pid, "ns/pid", path), buf,
+                             sizeof(buf));
+      if (n > 0) {
+        name.assign(buf, n);
+      } else if (errno == EACCES || errno == EPERM) {
+        name = "pidns of " + std::to_string(pid);
+      }
+    } else {
+      ScopedFd fd(openat(proc_fd_, TaskPath(pid, "cgroup", path),
+                         O_RDONLY | O_CLOEXEC));
+      PSTREE_COUNT(kSyscalls, 2);
+      ssize_t n = (fd.Get() >= 0 ? read(fd.Get(), buf, sizeof(buf)) : -1);
+      std::string_view lines(buf, std::max<ssize_t>(n, 0));
+      // hierarchy-ID:controllers:path lines, 0:: for cgroup v2.
+      std::size_t line = lines.find("\n0::");
+      line = (lines.substr(0, 3) == "0::" ? 0
+              : line == std::string_view::npos ? 0
+                                               : line + 1);
+      std::size_t colon = lines.find(':', line);
+      colon = (colon == std::string_view::npos ? colon
+                                               : lines.find(':', colon + 1));
+      if (colon != std::string_view::npos) {
+        std::size_t eol = lines.find('\n', colon);
+        name = "cgroup:";
+        name += lines.substr(colon + 1, eol == std::string_view::npos
+                                            ? std::string_view::npos
+                                            : eol - colon - 1);
+      }
+    }
+    return name.empty() ? NamePool::kNoId
+                        : NamePool::Get().Intern(name, sizeof(buf));
+  }
+
+  // The synthetic root of the group |name|, made for processes |ns_level|
+  // deep if it is new.
+  NodeIndex GroupRoot(NamePool::Id name, os_int ns_level) {
+    for (const Group &group : groups_) {
+      if (group.name == name) {
+        return group.root;
+      }
+    }
+    NodeIndex root = CreateTreeNode(name, kGroupRootPid, kGroupRootPid,
+                                    kGroupRootPid, 1);
+    // What is in the namespace itself is no deeper than the root.
+    nodes_[root].ns_level = ns_level;
+    groups_.push_back({name, root});
+    return root;
+  }
+
+  // Reads the rest of the tasks of other users that are drawn under a root
+  // of Roots(), which the uid filter only parsed up to their Uid: line.
+  void CompleteFilteredTasks() {
+    if (uid_filter_ < 0) {
+      return;
+    }
+    std::vector<NodeIndex> partial;
+    Walk(Roots(), [&](NodeView node) {
+      if (node->num_threads < 0) {
+        partial.push_back(node.Index());
+      }
+      return true;
+    });
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<TaskRecord> records(partial.size());
+    std::vector<char> ok(partial.size(), 0);
+    pool.ParallelFor(partial.size(), [&](std::size_t job, std::size_t) {
+      ok[job] = ParseTask(nodes_[partial[job]].pid, &records[job]);
+    });
+    std::vector<NodeIndex> threaded;
+    for (std::size_t job = 0; job < partial.size(); job++) {
+      TreeNode &node = nodes_[partial[job]];
+      if (!ok[job]) {
+        continue;
+      }
+      node.num_threads = records[job].threads;
+      node.has_threads = (records[job].threads > 1);
+      node.ns_level = records[job].ns_level;
+      if (node.has_threads) {
+        threaded.push_back(partial[job]);
+      }
+    }
+    if (thread_mode_ == ThreadMode::kExpand) {
+      ExpandThreads(threaded);
+    }
+  }
+
+  void RemoveNode(NodeIndex index) {
+    TreeNode &node = nodes_[index];
+    assert(node.alive);
+    node.alive = false;
+    node.parent = kNoNode;
+    if (nodes_map_.Find(node.pid) == index) {
+      nodes_map_.Erase(node.pid);
+    }
+    num_dead_++;
+  }
+
+  // Drops removed nodes from nodes_, keeping the order of the live ones.
+  void Compact() {
+    seen_.resize(nodes_.size(), 0);
+    std::vector<NodeIndex> remap(nodes_.size(), kNoNode);
+    NodeIndex live = 0;
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      if (nodes_[index].alive) {
+        remap[index] = live++;
+      }
+    }
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      NodeIndex to = remap[index];
+      if (to == kNoNode) {
+        continue;
+      }
+      TreeNode &node = nodes_[index];
+      node.parent = (node.parent == kNoNode ? kNoNode : remap[node.parent]);
+      if (to != index) {
+        nodes_[to] = std::move(node);
+        seen_[to] = seen_[index];
+      }
+    }
+    nodes_.erase(nodes_.begin() + live, nodes_.end());
+    seen_.resize(live);
+    for (NodeIndex &index : recent_) {
+      index = remap[index];
+    }
+    recent_.erase(std::remove(recent_.begin(), recent_.end(), kNoNode),
+                  recent_.end());
+    for (NodeIndex &index : orphans_) {
+      index = remap[index];
+    }
+    orphans_.erase(std::remove(orphans_.begin(), orphans_.end(), kNoNode),
+                   orphans_.end());
+    root_ = (root_ == kNoNode ? kNoNode : remap[root_]);
+    for (Group &group : groups_) {
+      group.root = remap[group.root];
+    }
+    nodes_map_.Clear();
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      nodes_map_.Set(nodes_[index].pid, index);
+    }
+    num_dead_ = 0;
+  }
+
+  // Orders the children of every node by |order|, until the next
+  // LinkChildren(). child_index_ already holds the children grouped by parent
+  // in parent order, so sorting the whole array on (parent, key) sorts every
+  // child range in place. Large trees are cut into chunks at parent
+  // boundaries that are sorted in parallel, and a chunk that is in order
+  // already, as a /proc scan mostly produces for kPid, only costs the check.
+  void SortTree(SortOrder order) {
+    PSTREE_PHASE(kSortTree);
+    std::size_t size = child_index_.size();
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::size_t num_chunks =
+        std::min(pool.Size(), std::max<std::size_t>(size / kSortChunkSize, 1));
+    std::vector<std::size_t> bounds(1, 0);
+    for (std::size_t chunk = 1; chunk < num_chunks; chunk++) {
+      std::size_t pos = std::max(bounds.back(), size * chunk / num_chunks);
+      while (pos > 0 && pos < size &&
+             nodes_[child_index_[pos]].parent ==
+                 nodes_[child_index_[pos - 1]].parent) {
+        pos++;
+      }
+      bounds.push_back(pos);
+    }
+    bounds.push_back(size);
+    auto less = [this, order](NodeIndex a, NodeIndex b) {
+      const TreeNode &lhs = nodes_[a];
+      const TreeNode &rhs = nodes_[b];
+      if (lhs.parent != rhs.parent) {
+        return lhs.parent < rhs.parent;
+      }
+      if (order == SortOrder::kName) {
+        int cmp = lhs.Name().compare(rhs.Name());
+        if (cmp != 0) {
+          return cmp < 0;
+        }
+      }
+      return lhs.pid < rhs.pid;
+    };
+    pool.ParallelFor(bounds.size() - 1, [&](std::size_t chunk, std::size_t) {
+      auto begin = child_index_.begin() + bounds[chunk];
+      auto end = child_index_.begin() + bounds[chunk + 1];
+      if (!std::is_sorted(begin, end, less)) {
+        std::sort(begin, end, less);
+      }
+    });
+  }
+
+  // pre-order traverse of pstree.
+  template <unsigned kColumns>
+  void PrintTree() const {
+    std::cout << std::endl << std::endl;
+    OutputBuffer out(STDOUT_FILENO);
+    RenderTree<kColumns>(&out);
+  }
+
+  void PrintTree(bool show_pids) const {
+    WithColumns(Columns(show_pids, resources_, args_size_ > 0),
+                [&](auto columns) {
+                  PrintTree<decltype(columns)::value>();
+                });
+  }
+
+  // Draws N*[name] for identical sibling subtrees from the next render on.
+  void SetFoldSubtrees(bool fold) { fold_subtrees_ = fold; }
+
+  // Limits the depth and line width of the renders from the next on.
+  void SetRenderLimits(RenderLimits limits) { render_limits_ = limits; }
+
+  // Shows the resident set and CPU usage of every process along with the
+  // totals of its subtree. CPU usage is averaged over the life of a process
+  // in the first snapshot and over the interval since the previous one in
+  // those of UpdateTree(). Set before building.
+  void SetResources(bool resources) {
+    resources_ = resources;
+    SelectParser();
+    if (resources_) {
+      SampleClock();
+    }
+  }
+
+  // Draws the arguments of every process after its name, at most |max_size|
+  // bytes of its command line, from the next FetchArgs() on. 0 draws none.
+  void SetArgs(std::size_t max_size) {
+    args_size_ = std::min(max_size, NamePool::kMaxEntrySize);
+  }
+
+  // Reads the arguments of the processes that the next render draws, within
+  // the depth limit and below the roots of the uid filter, and that have
+  // none yet; a tree kept up to date only reads the ones that are new or
+  // exec'd. The workers read the cmdline files into buffers of their own and
+  // the strings are interned once they are all in.
+  void FetchArgs() {
+    if (args_size_ == 0) {
+      return;
+    }
+    PSTREE_PHASE(kFetchArgs);
+    std::vector<NodeIndex> wanted;
+    std::size_t max_depth = render_limits_.max_depth;
+    Walk(Roots(), [&](NodeView node) {
+      if (!node->IsThread() && node->pid > 0 &&
+          node->args == NamePool::kNoId) {
+        wanted.push_back(node.Index());
+      }
+      // The stack holds the ancestors of |node|, as many as its depth.
+      return walk_.size() < max_depth;
+    });
+    struct Slice {
+      std::size_t worker = 0;
+      std::size_t begin = 0;
+      std::size_t end = 0;
+    };
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    args_buffers_.resize(std::max(args_buffers_.size(), pool.Size()));
+    for (std::string &buffer : args_buffers_) {
+      buffer.clear();
+    }
+    std::vector<Slice> slices(wanted.size());
+    pool.ParallelFor(wanted.size(), [&](std::size_t job, std::size_t worker) {
+      std::string *buffer = &args_buffers_[worker];
+      slices[job].worker = worker;
+      slices[job].begin = buffer->size();
+      const TreeNode &node = nodes_[wanted[job]];
+      ReadArgs(node.pid, node.Name(), buffer);
+      slices[job].end = buffer->size();
+    });
+    // Ones that could not be read get none rather than another try.
+    for (std::size_t job = 0; job < wanted.size(); job++) {
+      const Slice &slice = slices[job];
+      std::string_view args(args_buffers_[slice.worker].data() + slice.begin,
+                            slice.end - slice.begin);
+      nodes_[wanted[job]].args = NamePool::Get().Intern(args, args_size_);
+    }
+  }
+
+  // Appends the arguments of the process |pid| named |comm| to |buffer| as
+  // they are drawn: what follows argv[0] in the first args_size_ bytes of its
+  // cmdline file, separated by spaces, with control characters as '?'. A
+  // title the process gave itself in argv[0] (see TitleStart()) comes first.
+  // Appends nothing if the file cannot be read.
+  void ReadArgs(os_int pid, std::string_view comm,
+                std::string *buffer) const {
+    char path[64];
+    ScopedFd fd(openat(proc_fd_, TaskPath(pid, "cmdline", path),
+                       O_RDONLY | O_CLOEXEC));
+    PSTREE_COUNT(kSyscalls, 1);
+    if (fd.Get() < 0) {
+      return;
+    }
+    std::size_t begin = buffer->size();
+    buffer->resize(begin + args_size_);
+    char *cmdline = &(*buffer)[begin];
+    std::size_t len = 0;
+    while (len < args_size_) {
+      std::size_t want = args_size_ - len;
+      ssize_t n = read(fd.Get(), cmdline + len, want);
+      PSTREE_COUNT(kSyscalls, 1);
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      if (n <= 0) {
+        break;
+      }
+      PSTREE_COUNT(kBytesRead, n);
+      len += n;
+      // procfs fills a read up to the end of the command line, so a short
+      // one is the end and saves the read that would return 0.
+      if (static_cast<std::size_t>(n) < want) {
+        break;
+      }
+    }
+    const char *argv0_end =
+        static_cast<const char *>(memchr(cmdline, '\0', len));
+    std::size_t argv0_size =
+        (argv0_end != nullptr ? argv0_end - cmdline : len);
+    // Both are moved to the front of |cmdline| in place.
+    std::size_t size = 0;
+    auto copy = [&](const char *p, const char *end) {
+      for (; p < end; p++) {
+        unsigned char c = static_cast<unsigned char>(*p);
+        cmdline[size++] = (c == '\0'                ? ' '
+                           : (c < 0x20 || c == 0x7f) ? '?'
+                                                     : *p);
+      }
+    };
+    std::size_t title =
+        TitleStart(std::string_view(cmdline, argv0_size), comm);
+    if (title != std::string_view::npos) {
+      // Titles are often padded with spaces.
+      std::size_t title_end = argv0_size;
+      while (title_end > title && cmdline[title_end - 1] == ' ') {
+        title_end--;
+      }
+      copy(cmdline + title, cmdline + title_end);
+    }
+    if (argv0_end != nullptr) {
+      const char *p = argv0_end + 1;
+      const char *end = cmdline + len;
+      while (end > p && end[-1] == '\0') {
+        end--;
+      }
+      if (size > 0 && p < end) {
+        cmdline[size++] = ' ';
+      }
+      copy(p, end);
+    }
+    buffer->resize(begin + size);
+  }
+
+  // Where the title starts in |argv0| if a process named |comm| rewrote its
+  // argv[0] with one, as sshd and postgres do: "sshd: alice [priv]" is drawn
+  // as "alice [priv]" after the name. An argv[0] whose first word is
+  // |comm|, or a path to it, is no title. Otherwise the title follows |comm|
+  // or the first ": " or space, npos if nothing does.
+  static std::size_t TitleStart(std::string_view argv0,
+                                std::string_view comm) {
+    std::string_view word = argv0.substr(0, argv0.find(' '));
+    std::size_t slash = word.rfind('/');
+    std::string_view base =
+        (slash == std::string_view::npos ? word : word.substr(slash + 1));
+    // comm is cut to TASK_COMM_LEN - 1 bytes.
+    if (base == comm ||
+        (comm.size() >= 15 && base.substr(0, comm.size()) == comm)) {
+      return std::string_view::npos;
+    }
+    std::size_t start;
+    if (!comm.empty() && argv0.substr(0, comm.size()) == comm) {
+      start = comm.size();
+    } else if ((start = argv0.find(": ")) != std::string_view::npos) {
+      start += 2;
+    } else if ((start = argv0.find(' ')) == std::string_view::npos) {
+      return std::string_view::npos;
+    }
+    while (start < argv0.size() &&
+           (argv0[start] == ':' || argv0[start] == ' ')) {
+      start++;
+    }
+    return start < argv0.size() ? start : std::string_view::npos;
+  }
+
+  // Sums the resources of the processes of every subtree below |roots| in a
+  // single post-order pass. Indexed by node.
+  std::vector<ResourceTotal> SumResources(
+      const std::vector<NodeView> &roots) const {
+    std::vector<ResourceTotal> totals(nodes_.size());
+    Walk(roots, [](NodeView) { return true; }, [&](NodeView view) {
+      const TreeNode &node = *view;
+      ResourceTotal &total = totals[view.Index()];
+      if (!node.IsThread()) {
+        total.rss_kb += std::max<os_int>(node.rss_kb, 0);
+        total.cpu += std::max(node.cpu, 0.0f);
+      }
+      // The parent of a root is outside of the walk, adding to it is moot.
+      if (node.parent != kNoNode) {
+        totals[node.parent].rss_kb += total.rss_kb;
+        totals[node.parent].cpu += total.cpu;
+      }
+    });
+    return totals;
+  }
+
+  // Draws the tree with the Column set |kColumns|, which has
+  // kColumnResources if and only if SetResources() is on and kColumnArgs if
+  // SetArgs() is.
+  template <unsigned kColumns>
+  void RenderTree(OutputBuffer *out) const {
+    PSTREE_PHASE(kRenderTree);
+    constexpr bool kResources = (kColumns & kColumnResources) != 0;
+    assert(kResources == resources_);
+    assert(((kColumns & kColumnArgs) != 0) == (args_size_ > 0));
+    bool compact_threads = (thread_mode_ == ThreadMode::kCompact);
+    const std::vector<NodeView> roots = Roots();
+    if (fold_subtrees_) {
+      folder_.Fold(roots, nodes_.size(), compact_threads, &walk_);
+    }
+    std::vector<ResourceTotal> totals;
+    if (kResources) {
+      totals = SumResources(roots);
+    }
+    TreeRenderer<kColumns> renderer(out, compact_threads,
+                                    fold_subtrees_ ? &folder_ : nullptr,
+                                    kResources ? &totals : nullptr,
+                                    render_limits_, &walk_);
+    for (std::size_t i = 0; i < roots.size(); i++) {
+      if (i > 0) {
+        out->Put('\n');
+      }
+      renderer.Render(roots[i]);
+    }
+  }
+
+  // RenderTree() with the columns of |show_pids| and SetResources(), picked
+  // at runtime.
+  void RenderTree(bool show_pids, OutputBuffer *out) const {
+    WithColumns(Columns(show_pids, resources_, args_size_ > 0),
+                [&](auto columns) {
+                  RenderTree<decltype(columns)::value>(out);
+                });
+  }
+
+  // Writes the tree as a single line of nested JSON objects, or with a uid
+  // filter or groups an array of the trees.
+  void WriteJson(OutputBuffer *out) const {
+    const std::vector<NodeView> roots = Roots();
+    std::vector<ResourceTotal> totals;
+    if (resources_) {
+      totals = SumResources(roots);
+    }
+    const std::vector<ResourceTotal> *resources =
+        resources_ ? &totals : nullptr;
+    if (uid_filter_ >= 0 || group_mode_ != GroupMode::kNone) {
+      out->Put('[');
+      for (std::size_t i = 0; i < roots.size(); i++) {
+        if (i > 0) {
+          out->Put(',');
+        }
+        WriteJsonTree(roots[i], resources, out);
+      }
+      out->Put(']');
+    } else if (!roots.empty()) {
+      WriteJsonTree(roots[0], resources, out);
+    } else {
+      out->Append("null", 4);
+    }
+    out->Put('\n');
+  }
+
+  // Writes the tree as a binary snapshot, see SnapshotHeader.
+  void WriteBinary(OutputBuffer *out) const {
+    std::vector<SnapshotRecord> records;
+    std::vector<NodeIndex> order;
+    std::string strings;
+    for (NodeView root : Roots()) {
+      order.push_back(root.Index());
+    }
+    records.reserve(nodes_.size());
+    order.reserve(nodes_.size());
+    for (std::size_t i = 0; i < order.size(); i++) {
+      NodeView node = View(order[i]);
+      SnapshotRecord record;
+      record.pid = static_cast<std::int32_t>(node->pid);
+      record.tgid = static_cast<std::int32_t>(node->tgid);
+      record.ppid = static_cast<std::int32_t>(node->ppid);
+      record.num_threads = static_cast<std::int32_t>(node->num_threads);
+      record.name_offset = static_cast<std::uint32_t>(strings.size());
+      record.name_size = static_cast<std::uint32_t>(node->Name().size());
+      record.first_child = static_cast<std::uint32_t>(order.size());
+      record.num_children = node.Children().size();
+      strings.append(node->Name());
+      for (NodeView child : node.Children()) {
+        order.push_back(child.Index());
+      }
+      records.push_back(record);
+    }
+    strings.resize((strings.size() + 3) & ~std::size_t(3), '\0');
+
+    SnapshotHeader header;
+    memcpy(header.magic, kSnapshotMagic, sizeof(header.magic));
+    header.version = kSnapshotVersion;
+    header.record_size = sizeof(SnapshotRecord);
+    header.num_records = static_cast<std::uint32_t>(records.size());
+    header.strings_size = static_cast<std::uint32_t>(strings.size());
+    struct iovec iov[3] = {
+        {&header, sizeof(header)},
+        {records.data(), records.size() * sizeof(SnapshotRecord)},
+        {&strings[0], strings.size()}};
+    out->AppendV(iov, 3);
+  }
+
+  // Builds the tree from the cache SaveCache() wrote to |path| in an earlier
+  // run and brings it up to date with |pids|, a ReadProcs() listing of the
+  // procfs in which |inodes| are those of the process directories. The file
+  // is mapped and the tasks of its records taken as they are, parent links,
+  // names and arguments included. A listed process whose directory has a
+  // different inode is read again: the same start time means the same
+  // process, which gets the fresh name and parent but keeps the rest, while a
+  // reused pid is dropped for a new process. Then UpdateTree() removes what
+  // is not listed any more and reads what is new, so a warm run costs the
+  // listing, the thread counts and the changes. A process that exec'd without
+  // its directory changing keeps its cached name, as in --watch. Returns
+  // false, with nothing built, if there is no cache, or one of another procfs,
+  // boot or set of fields.
+  bool LoadCache(const std::string &path, const std::vector<os_int> &pids,
+                 const std::vector<std::uint64_t> &inodes) {
+    PSTREE_PHASE(kBuildTree);
+    MappedFile file(path);
+    CacheHeader expected;
+    if (file.Data() == nullptr || file.Size() < sizeof(CacheHeader) ||
+        !CacheHeaderFor(&expected)) {
+      return false;
+    }
+    CacheHeader header;
+    memcpy(&header, file.Data(), sizeof(header));
+    std::size_t num_records = header.snapshot.num_records;
+    std::size_t strings_size = header.snapshot.strings_size;
+    if (memcmp(header.snapshot.magic, kCacheMagic, sizeof(kCacheMagic)) != 0 ||
+        header.snapshot.version != kCacheVersion ||
+        header.snapshot.record_size != sizeof(CacheRecord) ||
+        file.Size() != sizeof(CacheHeader) +
+                           num_records * sizeof(CacheRecord) + strings_size ||
+        header.fields != expected.fields ||
+        header.args_size != expected.args_size ||
+        header.proc_dev != expected.proc_dev ||
+        header.proc_ino != expected.proc_ino ||
+        memcmp(header.boot_id, expected.boot_id, sizeof(header.boot_id)) !=
+            0) {
+      return false;
+    }
+    const CacheRecord *records =
+        reinterpret_cast<const CacheRecord *>(file.Data() + sizeof(header));
+    const char *strings = file.Data() + sizeof(header) +
+                          num_records * sizeof(CacheRecord);
+    for (std::size_t i = 0; i < num_records; i++) {
+      const CacheRecord &record = records[i];
+      if (std::size_t(record.node.name_offset) + record.node.name_size >
+              strings_size ||
+          (record.args_offset != kNoCacheArgs &&
+           std::size_t(record.args_offset) + record.args_size >
+               strings_size)) {
+        return false;
+      }
+    }
+
+    nodes_.reserve(num_records + 1);
+    std::vector<std::uint64_t> cached_inodes(num_records);
+    for (std::size_t i = 0; i < num_records; i++) {
+      const CacheRecord &record = records[i];
+      NodeIndex index = CreateTreeNode(
+          std::string_view(strings + record.node.name_offset,
+                           record.node.name_size),
+          record.node.pid, record.node.tgid, record.node.ppid,
+          record.node.num_threads);
+      TreeNode &node = nodes_[index];
+      node.uid = record.uid;
+      node.ns_level = record.ns_level;
+      node.start_ticks = record.start_ticks;
+      if (record.args_offset != kNoCacheArgs) {
+        node.args = NamePool::Get().Intern(
+            std::string_view(strings + record.args_offset, record.args_size),
+            args_size_);
+      }
+      cached_inodes[index] = record.dir_ino;
+    }
+    // Create virtual kernal node.
+    std::string virtual_root("kernal");
+    CreateTreeNode(virtual_root, 0, 0, 0, 1);
+    cached_inodes.push_back(0);
+    LinkTree();
+
+    std::vector<NodeIndex> changed;
+    for (std::size_t i = 0; i < pids.size(); i++) {
+      NodeIndex index = nodes_map_.Find(pids[i]);
+      if (index < cached_inodes.size() && !nodes_[index].IsThread() &&
+          cached_inodes[index] != inodes[i]) {
+        changed.push_back(index);
+      }
+    }
+    WorkStealingPool serial_pool(1);
+    WorkStealingPool &pool = (pool_ != nullptr ? *pool_ : serial_pool);
+    std::vector<TaskRecord> fresh(changed.size());
+    std::vector<char> ok(changed.size(), 0);
+    pool.ParallelFor(changed.size(), [&](std::size_t job, std::size_t) {
+      ok[job] = ParseTask(nodes_[changed[job]].pid, &fresh[job]);
+    });
+    for (std::size_t job = 0; job < changed.size(); job++) {
+      TreeNode &node = nodes_[changed[job]];
+      if (!ok[job]) {
+        // Gone meanwhile, the next run finds it missing.
+        continue;
+      }
+      if (node.start_ticks < 0 || fresh[job].start_ticks != node.start_ticks) {
+        // Unlisted as far as UpdateTree() can tell: it removes the old
+        // process, rereads its children and creates the new one.
+        nodes_map_.Erase(node.pid);
+        continue;
+      }
+      node.name = NamePool::Get().Intern(fresh[job].name);
+      node.ppid = fresh[job].ppid;
+      // Threads are drawn with the name of their process.
+      for (NodeView child : View(changed[job]).Children()) {
+        if (child->IsThread()) {
+          nodes_[child.Index()].name = node.name;
+        }
+      }
+      NodeIndex parent = nodes_map_.Find(node.ppid);
+      node.parent = (parent == changed[job] ? kNoNode : parent);
+    }
+    UpdateTree(pids);
+    return true;
+  }
+
+  // Writes every task of the tree to |path| for LoadCache(), with the inodes
+  // of the process directories from |pids| and |inodes|, the listing the tree
+  // was built from. The file is written next to |path| and renamed over it,
+  // so a concurrent run maps either the old or the new one. Returns false if
+  // it could not be written.
+  bool SaveCache(const std::string &path, const std::vector<os_int> &pids,
+                 const std::vector<std::uint64_t> &inodes) const {
+    CacheHeader header;
+    if (!CacheHeaderFor(&header)) {
+      return false;
+    }
+    std::vector<std::uint64_t> node_inodes(nodes_.size(), 0);
+    for (std::size_t i = 0; i < pids.size(); i++) {
+      NodeIndex index = nodes_map_.Find(pids[i]);
+      if (index != kNoNode) {
+        node_inodes[index] = inodes[i];
+      }
+    }
+    std::vector<CacheRecord> records;
+    records.reserve(nodes_.size());
+    std::string strings;
+    // Names repeat a lot, each is stored once.
+    std::unordered_map<NamePool::Id, std::uint32_t> offsets;
+    auto add_string = [&](NamePool::Id id) {
+      auto it = offsets.emplace(id, static_cast<std::uint32_t>(strings.size()));
+      if (it.second) {
+        strings.append(NamePool::Get().View(id));
+      }
+      return it.first->second;
+    };
+    for (NodeIndex index = 0; index < nodes_.size(); index++) {
+      const TreeNode &node = nodes_[index];
+      // The kernal and group roots are made anew.
+      if (!node.alive || node.pid <= 0) {
+        continue;
+      }
+      CacheRecord record = {};
+      record.node.pid = static_cast<std::int32_t>(node.pid);
+      record.node.tgid = static_cast<std::int32_t>(node.tgid);
+      record.node.ppid = static_cast<std::int32_t>(node.ppid);
+      record.node.num_threads = static_cast<std::int32_t>(node.num_threads);
+      record.node.name_offset = add_string(node.name);
+      record.node.name_size = static_cast<std::uint32_t>(node.Name().size());
+      record.start_ticks = node.start_ticks;
+      record.dir_ino = node_inodes[index];
+      record.args_offset = kNoCacheArgs;
+      if (node.args != NamePool::kNoId) {
+        record.args_offset = add_string(node.args);
+        record.args_size = static_cast<std::uint32_t>(node.Args().size());
+      }
+      record.uid = static_cast<std::int32_t>(node.uid);
+      record.ns_level = static_cast<std::int32_t>(node.ns_level);
+      records.push_back(record);
+    }
+    header.snapshot.num_records = static_cast<std::uint32_t>(records.size());
+    header.snapshot.strings_size = static_cast<std::uint32_t>(strings.size());
+
+    std::string temp = path + "." + std::to_string(getpid()) + ".tmp";
+    ScopedFd fd(open(temp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644));
+    PSTREE_COUNT(kSyscalls, 1);
+    if (fd.Get() < 0) {
+      return false;
+    }
+    {
+      OutputBuffer out(fd.Get());
+      struct iovec iov[3] = {
+          {&header, sizeof(header)},
+          {records.data(), records.size() * sizeof(CacheRecord)},
+          {&strings[0], strings.size()}};
+      out.AppendV(iov, 3);
+    }
+    struct stat st;
+    PSTREE_COUNT(kSyscalls, 2);
+    if (fstat(fd.Get(), &st) != 0 ||
+        static_cast<std::size_t>(st.st_size) !=
+            sizeof(header) + records.size() * sizeof(CacheRecord) +
+                strings.size() ||
+        rename(temp.c_str(), path.c_str()) != 0) {
+      unlink(temp.c_str());
+      return false;
+    }
+    return true;
+  }
+
+private:
+  // Fills |header| with what a cache of this tree is written and only taken
+  // with: the parser fields, thread mode and argument cap, and the identity
+  // of the procfs and of the boot. Returns false if the procfs is gone.
+  bool CacheHeaderFor(CacheHeader *header) const {
+    memset(header, 0, sizeof(*header));
+    memcpy(header->snapshot.magic, kCacheMagic, sizeof(kCacheMagic));
+    header->snapshot.version = kCacheVersion;
+    header->snapshot.record_size = sizeof(CacheRecord);
+    header->fields = Fields() | static_cast<std::uint32_t>(thread_mode_) << 8;
+    header->args_size = static_cast<std::uint32_t>(args_size_);
+    struct stat st;
+    PSTREE_COUNT(kSyscalls, 1);
+    if (fstat(proc_fd_, &st) != 0) {
+      return false;
+    }
+    header->proc_dev = st.st_dev;
+    header->proc_ino = st.st_ino;
+    ScopedFd fd(openat(proc_fd_, "sys/kernel/random/boot_id",
+                       O_RDONLY | O_CLOEXEC));
+    PSTREE_COUNT(kSyscalls, 1);
+    if (fd.Get() >= 0) {
+      PSTREE_COUNT(kSyscalls, 1);
+      ssize_t n = read(fd.Get(), header->boot_id, sizeof(header->boot_id) - 1);
+      if (n < 0) {
+        header->boot_id[0] = '\0';
+      }
+    }
+    return true;
+  }
+
+  // Writes the subtree of |root| as nested objects, each closed once the
+  // walk leaves it.
+  void WriteJsonTree(NodeView root, const std::vector<ResourceTotal> *totals,
+                     OutputBuffer *out) const {
+    Walk(std::vector<NodeView>(1, root),
+         [&](NodeView node) {
+           // The top of the walk is the parent, past the first child once
+           // |node| is a later one.
+           if (!walk_.empty() && walk_.back().next > 1) {
+             out->Put(',');
+           }
+           WriteJsonNode(node, totals, out);
+           return true;
+         },
+         [&](NodeView) { out->Append("]}", 2); });
+  }
+
+  // Writes the contents of a JSON string holding |str|.
+  static void WriteJsonString(std::string_view str, OutputBuffer *out) {
+    for (char c : str) {
+      unsigned char byte = static_cast<unsigned char>(c);
+      if (c == '"' || c == '\\') {
+        out->Put('\\');
+        out->Put(c);
+      } else if (byte < 0x20) {
+        static const char kHex[] = "0123456789abcdef";
+        out->Append("\\u00", 4);
+        out->Put(kHex[byte >> 4]);
+        out->Put(kHex[byte & 0xf]);
+      } else {
+        out->Put(c);
+      }
+    }
+  }
+
+  // Writes the object of |node| up to the opening of its "children" array.
+  // A process whose arguments were fetched has them as "args". With |totals|
+  // a process also gets "rss_kb", "cpu" and the same of its subtree as
+  // "total_rss_kb" and "total_cpu", null while unknown.
+  void WriteJsonNode(NodeView node, const std::vector<ResourceTotal> *totals,
+                     OutputBuffer *out) const {
+    out->Append("{\"name\":\"", 9);
+    WriteJsonString(node->Name(), out);
+    if (node->args != NamePool::kNoId) {
+      out->Append("\",\"args\":\"", 10);
+      WriteJsonString(node->Args(), out);
+    }
+    out->Append("\",\"pid\":", 8);
+    out->AppendInt(node->pid);
+    out->Append(",\"tgid\":", 8);
+    out->AppendInt(node->tgid);
+    out->Append(",\"ppid\":", 8);
+    out->AppendInt(node->ppid);
+    out->Append(",\"threads\":", 11);
+    out->AppendInt(node->num_threads);
+    if (totals != nullptr && !node->IsThread()) {
+      const ResourceTotal &total = (*totals)[node.Index()];
+      char buf[128];
+      int len = snprintf(buf, sizeof(buf), ",\"rss_kb\":");
+      len += node->rss_kb < 0
+                 ? snprintf(buf + len, sizeof(buf) - len, "null")
+                 : snprintf(buf + len, sizeof(buf) - len, "%lld",
+                            static_cast<long long>(node->rss_kb));
+      len += node->cpu < 0
+                 ? snprintf(buf + len, sizeof(buf) - len,
+                            ",\"cpu\":null,\"total_rss_kb\":%lld,"
+                            "\"total_cpu\":null",
+                            static_cast<long long>(total.rss_kb))
+                 : snprintf(buf + len, sizeof(buf) - len,
+                            ",\"cpu\":%.1f,\"total_rss_kb\":%lld,"
+                            "\"total_cpu\":%.1f",
+                            node->cpu, static_cast<long long>(total.rss_kb),
+                            total.cpu);
+      out->Append(buf, len);
+    }
+    out->Append(",\"children\":[", 13);
+  }
+
+  // The ProcField set the uid filter, the resources, the groups and the
+  // start times need.
+  unsigned Fields() const {
+    return (uid_filter_ >= 0 ? kFieldUid : 0u) |
+           (resources_ ? kFieldResources : 0u) |
+           (group_mode_ != GroupMode::kNone ? kFieldNamespace : 0u) |
+           (start_times_ ? kFieldStartTime : 0u);
+  }
+
+  // Picks the parser instantiation for Fields().
+  void SelectParser() { parse_ = SelectProcParser(format_, Fields()); }
+
+  // Takes the time of a snapshot: the uptime start times are relative to and
+  // the interval since the previous one.
+  void SampleClock() {
+    auto now = std::chrono::steady_clock::now();
+    interval_ = (sampled_ ? std::chrono::duration<double>(now - sample_time_)
+                                .count()
+                          : 0);
+    sample_time_ = now;
+    sampled_ = true;
+    uptime_ = -1;
+    char buf[64];
+    ScopedFd fd(openat(proc_fd_, "uptime", O_RDONLY | O_CLOEXEC));
+    PSTREE_COUNT(kSyscalls, 2);
+    ssize_t n = (fd.Get() >= 0 ? read(fd.Get(), buf, sizeof(buf) - 1) : -1);
+    if (n > 0) {
+      buf[n] = '\0';
+      uptime_ = strtod(buf, nullptr);
+    }
+  }
+
+  // Sets the resources of |node| from |record|. CPU usage is taken against
+  // the previous sample of the node when |update|s it, or else over its life.
+  void SampleResources(const TaskRecord &record, bool update,
+                       TreeNode *node) const {
+    static const double kClockTicks = sysconf(_SC_CLK_TCK);
+    node->rss_kb = record.rss_kb;
+    if (record.cpu_ticks < 0) {
+      node->cpu_ticks = -1;
+      node->cpu = -1;
+      return;
+    }
+    if (update && node->cpu_ticks >= 0 && interval_ > 0) {
+      node->cpu = static_cast<float>(
+          100.0 * std::max<os_int>(record.cpu_ticks - node->cpu_ticks, 0) /
+          kClockTicks / interval_);
+    } else if (uptime_ > 0 && record.start_ticks >= 0) {
+      double age = uptime_ - record.start_ticks / kClockTicks;
+      node->cpu = static_cast<float>(
+          age > 0 ? 100.0 * record.cpu_ticks / kClockTicks / age : 0);
+    } else {
+      node->cpu = -1;
+    }
+    node->cpu_ticks = record.cpu_ticks;
+  }
+
+  int proc_fd_;
+  std::string proc_path_;
+  ProcFormat format_ = ProcFormat::kStatus;
+  // The parser of format_ for just the fields the settings use.
+  ProcParser parse_;
+  ThreadMode thread_mode_ = ThreadMode::kExpand;
+  bool fold_subtrees_ = false;
+  RenderLimits render_limits_;
+  // Scratch of the walks and of folding, reused by every snapshot.
+  mutable WalkStack walk_;
+  mutable SubtreeFolder folder_;
+  // SetArgs() and the cmdline buffers of the workers of FetchArgs(), which
+  // keep their capacity from one snapshot to the next.
+  std::size_t args_size_ = 0;
+  std::vector<std::string> args_buffers_;
+  // State of SetResources(): the uptime in seconds at the last snapshot, -1
+  // if unknown, and the seconds since the one before.
+  bool resources_ = false;
+  bool sampled_ = false;
+  std::chrono::steady_clock::time_point sample_time_;
+  double uptime_ = -1;
+  double interval_ = 0;
+  os_int root_pid_ = 1;
+  os_int uid_filter_ = -1;
+  // SetGroupMode() and the synthetic roots of GroupTasks(), by name in the
+  // order they were made; there are as many as containers.
+  struct Group {
+    NamePool::Id name;
+    NodeIndex root;
+  };
+  GroupMode group_mode_ = GroupMode::kNone;
+  std::vector<Group> groups_;
+  bool start_times_ = false;
+  WorkStealingPool *pool_ = nullptr;
+  // One ring per worker with UseUring(), created on first use.
+  std::vector<std::unique_ptr<UringReader>> rings_;
+  NodeIndex root_ = kNoNode;
+  std::vector<TreeNode> nodes_;
+  std::vector<NodeIndex> child_index_;
+  PidTable nodes_map_;
+  // State of UpdateTree(): the update in which each process of nodes_ was
+  // last listed.
+  std::uint32_t generation_ = 0;
+  std::vector<std::uint32_t> seen_;
+  // Processes created by the last update, re-read once by the next one.
+  std::vector<NodeIndex> recent_;
+  std::vector<NodeIndex> orphans_;
+  std::size_t num_dead_ = 0;
+};
+
+void PrintVersion() { std::cout << "my_pstree v1.0." << std::endl; }
+
+// The width lines written to |fd| are clipped to, like GNU pstree: one column
+// short of $COLUMNS or else of the terminal, for the '+'. 0 when |fd| is no
+// terminal and COLUMNS is not set.
+std::size_t OutputWidth(int fd) {
+  std::size_t columns = 0;
+  const char *env = getenv("COLUMNS");
+  if (env != nullptr) {
+    columns = strtoul(env, nullptr, 10);
+  }
+  struct winsize size;
+  if (columns == 0 && isatty(fd) && ioctl(fd, TIOCGWINSZ, &size) == 0) {
+    columns = size.ws_col;
+  }
+  return columns > 1 ? columns - 1 : 0;
+}
+
+// Size of the getdents64 buffer, enough for a full /proc of a busy host in a
+// handful of calls.
+constexpr std::size_t kDirentBufSize = 64 * 1024;
+
+// Lists the numeric entries of |dir_fd|, a /proc or /proc/<pid>/task
+// directory, except |skip|, and with |inodes| the inode number of each. The
+// directory is rewound first so the same fd can be listed again for the next
+// snapshot.
+void ReadProcs(int dir_fd, os_int skip, std::vector<os_int> *pids,
+               std::vector<std::uint64_t> *inodes) {
+  PSTREE_PHASE(kReadProcs);
+  PSTREE_COUNT(kSyscalls, 1);
+  if (dir_fd < 0 || lseek(dir_fd, 0, SEEK_SET) < 0) {
+    return;
+  }
+  alignas(8) char buf[kDirentBufSize];
+  for (;;) {
+    long len = syscall(SYS_getdents64, dir_fd, buf, sizeof(buf));
+    PSTREE_COUNT(kSyscalls, 1);
+    if (len <= 0) {
+      break;
+    }
+    for (long pos = 0; pos < len;) {
+      const struct dirent64 *entry =
+          reinterpret_cast<const struct dirent64 *>(buf + pos);
+      pos += entry->d_reclen;
+      if (entry->d_type != DT_DIR && entry->d_type != DT_UNKNOWN) {
+        continue;
+      }
+      const char *name = entry->d_name;
+      const char *end = name + strlen(name);
+      os_int pid;
+      if (DecodeInt(name, end, &pid) != end || pid == skip) {
+        continue;
+      }
+      pids->push_back(pid);
+      if (inodes != nullptr) {
+        inodes->push_back(entry->d_ino);
+      }
+    }
+  }
+}
+
+// Subscription to the kernel's process events (the cn_proc multicast group
+// of the netlink connector). Listening needs CAP_NET_ADMIN.
+class ProcConnector {
+ public:
+  ProcConnector() = default;
+  ~ProcConnector() {
+    if (fd_ >= 0) {
+      SendOp(PROC_CN_MCAST_IGNORE);
+      close(fd_);
+    }
+  }
+
+  ProcConnector(const ProcConnector &) = delete;
+  ProcConnector &operator=(const ProcConnector &) = delete;
+
+  bool Open() {
+    fd_ = socket(AF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC | SOCK_NONBLOCK,
+                 NETLINK_CONNECTOR);
+    if (fd_ < 0) {
+      return false;
+    }
+    // Events come in bursts (think make -j), give them room.
+    int rcvbuf = 4 * 1024 * 1024;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    struct sockaddr_nl addr = {};
+    addr.nl_family = AF_NETLINK;
+    addr.nl_groups = CN_IDX_PROC;
+    if (bind(fd_, reinterpret_cast<struct sockaddr *>(&addr), sizeof(addr)) !=
+            0 ||
+        !SendOp(PROC_CN_MCAST_LISTEN)) {
+      close(fd_);
+      fd_ = -1;
+      return false;
+    }
+    return true;
+  }
+
+  int Fd() const { return fd_; }
+
+  // Hands every queued event to |handler|. Returns false if events were
+  // dropped because the socket buffer overflowed, in which case the caller
+  // has to resynchronize from /proc.
+  template <typename Handler>
+  bool Drain(Handler &&handler) {
+    alignas(struct nlmsghdr) char buf[64 * 1024];
+    for (;;) {
+      ssize_t len = recv(fd_, buf, sizeof(buf), 0);
+      if (len < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return errno != ENOBUFS;
+      }
+      for (struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(buf);
+           NLMSG_OK(nlh, static_cast<std::size_t>(len));
+           nlh = NLMSG_NEXT(nlh, len)) {
+        if (nlh->nlmsg_type == NLMSG_NOOP || nlh->nlmsg_type == NLMSG_ERROR) {
+          continue;
+        }
+        const struct cn_msg *msg =
+            static_cast<const struct cn_msg *>(NLMSG_DATA(nlh));
+        if (msg->id.idx != CN_IDX_PROC || msg->id.val != CN_VAL_PROC ||
+            msg->len < sizeof(struct proc_event)) {
+          continue;
+        }
+        handler(*reinterpret_cast<const struct proc_event *>(msg->data));
+      }
+    }
+  }
+
+ private:
+  bool SendOp(enum proc_cn_mcast_op op) {
+    // nlmsghdr, then cn_msg followed by the operation as its payload.
+    constexpr std::size_t kLen =
+        NLMSG_LENGTH(sizeof(struct cn_msg) + sizeof(enum proc_cn_mcast_op));
+    alignas(struct nlmsghdr) char req[kLen] = {};
+    struct nlmsghdr *nlh = reinterpret_cast<struct nlmsghdr *>(req);
+    nlh->nlmsg_len = kLen;
+    nlh->nlmsg_type = NLMSG_DONE;
+    nlh->nlmsg_pid = getpid();
+    struct cn_msg *msg = static_cast<struct cn_msg *>(NLMSG_DATA(nlh));
+    msg->id.idx = CN_IDX_PROC;
+    msg->id.val = CN_VAL_PROC;
+    msg->len = sizeof(op);
+    memcpy(msg->data, &op, sizeof(op));
+    return send(fd_, req, kLen, 0) == static_cast<ssize_t>(kLen);
+  }
+
+  int fd_ = -1;
+};
+
+// What a snapshot is written as: the ascii art tree, one line of JSON or a
+// binary snapshot (see SnapshotHeader).
+enum class OutputFormat { kText, kJson, kBinary };
+
+// Bytes of a command line -a reads unless --args-max says otherwise: a page,
+// past which there is little to tell workers apart by but a classpath.
+constexpr std::size_t kDefaultArgsSize = 4096;
+
+struct PstreeOptions {
+  bool show_pids = false;
+  bool numeric_sort = false;
+  ProcFormat format = ProcFormat::kStatus;
+  std::size_t num_jobs = 1;
+  // Seconds between two snapshots with --watch, 0 prints a single one.
+  double watch_interval = 0;
+  // Follow the proc connector instead of rescanning /proc in --watch mode.
+  bool proc_events = false;
+  // Enumerate tasks with a BPF task iterator, /proc remains the fallback.
+  bool bpf_tasks = false;
+  // Read status files through io_uring, the synchronous reads remain the
+  // fallback.
+  bool uring = false;
+  // Walk down the children files from init instead of linking a full scan.
+  bool children_walk = false;
+  ThreadMode thread_mode = ThreadMode::kExpand;
+  // Draw identical sibling subtrees once as N*[name].
+  bool fold_subtrees = false;
+  // --max-depth, and the terminal width text lines are clipped to.
+  RenderLimits render_limits;
+  // Watch modes write one JSON line or binary snapshot per update.
+  OutputFormat output = OutputFormat::kText;
+  // The procfs to read, a synthetic one from --gen-fixture for benchmarks.
+  std::string proc_root = "/proc";
+  // Time the phases of a run instead of printing the tree.
+  bool benchmark = false;
+  // Report PstreeStats on stderr after every snapshot.
+  bool stats = false;
+  // Draw only the subtree of this pid, -1 for all of init's.
+  os_int root_pid = -1;
+  // Draw only the trees of processes of this uid, -1 for everyone's.
+  os_int uid_filter = -1;
+  // Annotate processes with their resident set and CPU usage.
+  bool resources = false;
+  // With -a, the bytes of a command line read for the arguments drawn after
+  // the name, 0 for none.
+  std::size_t args_size = 0;
+  // Draw every container under a root of its own, see PsTree::GroupTasks().
+  GroupMode group = GroupMode::kNone;
+  // The file a single snapshot starts from and is saved to, see
+  // PsTree::LoadCache(), empty for none.
+  std::string cache_path;
+  // [host:]port to publish snapshots on with --serve, every watch_interval.
+  std::string serve_address;
+  // host:port of the --serve hosts to draw the trees of instead of /proc.
+  std::vector<std::string> hosts;
+};
+
+// Writes a snapshot of |pstree| in a machine readable |output| format.
+void ExportTree(const PsTree &pstree, OutputFormat output) {
+  OutputBuffer out(STDOUT_FILENO);
+  if (output == OutputFormat::kJson) {
+    pstree.WriteJson(&out);
+  } else {
+    pstree.WriteBinary(&out);
+  }
+}
+
+// Applies proc connector events to a tree seeded from /proc.
+class ProcEventTracker {
+ public:
+  explicit ProcEventTracker(PsTree *pstree) : pstree_(pstree) {}
+
+  void Apply(const struct proc_event &event) {
+    switch (event.what) {
+      case proc_event::PROC_EVENT_FORK: {
+        const auto &fork = event.event_data.fork;
+        // parent_* is the real parent, which for a new thread is the parent
+        // of its process; a child starts with the name of what it was cloned
+        // from.
+        NodeView origin = pstree_->FindTask(
+            fork.child_pid != fork.child_tgid ? fork.child_tgid
+                                              : fork.parent_tgid);
+        std::string name(origin ? origin->Name() : std::string_view());
+        if (name.empty()) {
+          ReadName(fork.child_tgid, &name);
+        }
+        pstree_->AddTask(name, fork.child_pid, fork.child_tgid,
+                         fork.parent_tgid, 1);
+        break;
+      }
+      case proc_event::PROC_EVENT_EXEC: {
+        const auto &exec = event.event_data.exec;
+        std::string name;
+        if (ReadName(exec.process_tgid, &name)) {
+          pstree_->RenameTask(exec.process_tgid, name);
+        }
+        break;
+      }
+      case proc_event::PROC_EVENT_COMM: {
+        const auto &comm = event.event_data.comm;
+        // Threads show the name of their process, only the leader counts.
+        if (comm.process_pid == comm.process_tgid) {
+          pstree_->RenameTask(comm.process_pid,
+                              std::string(comm.comm, strnlen(comm.comm,
+                                                             sizeof(comm.comm))));
+        }
+        break;
+      }
+      case proc_event::PROC_EVENT_EXIT:
+        pstree_->RemoveTask(event.event_data.exit.process_pid,
+                            event.event_data.exit.process_tgid);
+        break;
+      default:
+        return;
+    }
+    dirty_ = true;
+  }
+
+  // Links the tree and moves the children of exited processes under the
+  // ancestor the kernel reparented them to. The exit event is sent after the
+  // reparenting, so their status already has the new PPid.
+  void Link() {
+    pstree_->LinkChildren();
+    std::vector<NodeIndex> orphans = pstree_->TakeOrphans();
+    if (orphans.empty()) {
+      return;
+    }
+    for (NodeIndex index : orphans) {
+      const TreeNode &node = *pstree_->View(index);
+      TaskRecord record;
+      if (pstree_->ParseTask(node.pid, &record)) {
+        pstree_->ReparentTask(record.pid, record.ppid);
+      }
+    }
+    pstree_->LinkChildren();
+    pstree_->TakeOrphans();
+  }
+
+  bool TakeDirty() {
+    bool dirty = dirty_;
+    dirty_ = false;
+    return dirty;
+  }
+
+ private:
+  bool ReadName(os_int pid, std::string *name) const {
+    TaskRecord record;
+    if (!pstree_->ParseTask(pid, &record)) {
+      return false;
+    }
+    *name = record.name;
+    return true;
+  }
+
+  PsTree *pstree_;
+  bool dirty_ = false;
+};
+
+// --watch with --events: subscribe first so nothing that happens while /proc
+// is scanned gets lost, seed the tree from /proc, then only apply events.
+void WatchProcEvents(const PstreeOptions &options, int proc_fd, PsTree *pstree,
+                     ProcConnector *connector) {
+  ProcEventTracker tracker(pstree);
+  FramePainter painter(STDOUT_FILENO, isatty(STDOUT_FILENO));
+  std::string frame;
+  auto apply = [&tracker](const struct proc_event &event) {
+    tracker.Apply(event);
+  };
+  bool redraw = true;
+  for (;;) {
+    if (!connector->Drain(apply)) {
+      // Events were lost, rescan once to get back in sync.
+      std::vector<os_int> pids;
+      ReadProcs(proc_fd, -1, &pids);
+      pstree->UpdateTree(pids);
+      redraw = true;
+    }
+    if (tracker.TakeDirty() || redraw) {
+      tracker.Link();
+      pstree->MaybeCompact();
+      pstree->LinkChildren();
+      pstree->GroupTasks();
+      pstree->SortTree(options.numeric_sort ? SortOrder::kPid
+                                            : SortOrder::kName);
+      pstree->FetchArgs();
+      if (options.output != OutputFormat::kText) {
+        ExportTree(*pstree, options.output);
+      } else {
+        frame.clear();
+        {
+          OutputBuffer out(&frame);
+          pstree->RenderTree(options.show_pids, &out);
+        }
+        painter.Paint(frame);
+      }
+      if (options.stats) {
+        PrintStats();
+      }
+      redraw = false;
+      // Batch whatever happens within the interval into the next frame.
+      std::this_thread::sleep_for(
+          std::chrono::duration<double>(options.watch_interval));
+    }
+    struct pollfd pfd = {connector->Fd(), POLLIN, 0};
+    poll(&pfd, 1, -1);
+  }
+}
+
+// The --serve wire protocol, in the byte order of the server. A client sends a
+// DeltaRequest with the epoch and generation of the last snapshot it applied
+// and gets a DeltaHeader followed by
+//
+//   DeltaTask[num_tasks] | removed pids (int32)[num_removed] | string table
+//
+// which takes it from snapshot |base| to |generation|. Tasks are the
+// processes added or changed since |base|, and the pids the ones that exited.
+// A client that is more than one snapshot behind, or has nothing yet, gets
+// every process with kDeltaFull set. Threads travel as counts only.
+struct DeltaRequest {
+  char magic[4];
+  std::uint32_t epoch;
+  std::uint32_t generation;
+};
+
+struct DeltaHeader {
+  char magic[4];
+  std::uint16_t version;
+  std::uint16_t flags;
+  // Tells a restarted server apart, whose generations start over.
+  std::uint32_t epoch;
+  std::uint32_t base;
+  std::uint32_t generation;
+  std::uint32_t num_tasks;
+  std::uint32_t num_removed;
+  std::uint32_t strings_size;
+};
+
+struct DeltaTask {
+  std::int32_t pid;
+  std::int32_t ppid;
+  std::int32_t num_threads;
+  std::uint32_t name_offset;
+  std::uint32_t name_size;
+};
+
+static_assert(sizeof(DeltaRequest) == 12, "DeltaRequest is 12 bytes");
+static_assert(sizeof(DeltaHeader) == 32, "DeltaHeader is 32 bytes");
+static_assert(sizeof(DeltaTask) == 20, "DeltaTask is 20 bytes");
+
+constexpr char kDeltaMagic[4] = {'P', 'S', 'T', 'D'};
+constexpr std::uint16_t kDeltaVersion = 1;
+constexpr std::uint16_t kDeltaFull = 1;
+// Bounds a client accepts, against a peer that is not a pstree server.
+constexpr std::uint32_t kMaxDeltaTasks = 1 << 24;
+constexpr std::uint32_t kMaxDeltaStrings = 1 << 28;
+
+// Splits "host:port", or "[v6 address]:port", and resolves it. With
+// |passive| an empty host is every local address.
+bool ResolveAddress(const std::string &address, bool passive,
+                    struct sockaddr_storage *addr, socklen_t *addr_len,
+                    std::string *error) {
+  std::size_t colon = address.rfind(':');
+  std::string host = address.substr(0, colon == std::string::npos ? 0 : colon);
+  std::string port = address.substr(colon == std::string::npos ? 0 : colon + 1);
+  if (host.size() >= 2 && host.front() == '[' && host.back() == ']') {
+    host = host.substr(1, host.size() - 2);
+  }
+  if (port.empty() || (host.empty() && !passive)) {
+    *error = "expected host:port";
+    return false;
+  }
+  struct addrinfo hints = {};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  struct addrinfo *result = nullptr;
+  int rc = getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                       &hints, &result);
+  if (rc != 0) {
+    *error = gai_strerror(rc);
+    return false;
+  }
+  memcpy(addr, result->ai_addr, result->ai_addrlen);
+  *addr_len = result->ai_addrlen;
+  freeaddrinfo(result);
+  return true;
+}
+
+// An immutable snapshot of the processes of a tree, in pid order, with the
+// --serve responses to a client at it, at the one before and elsewhere. It is
+// built whole before being published and never changes afterwards; the
+// responses outlive it for as long as a connection still sends one. Names are
+// NamePool ids, only the builder thread may look them up.
+struct TreeSnapshot {
+  struct Task {
+    os_int pid;
+    os_int ppid;
+    os_int threads;
+    NamePool::Id name;
+  };
+
+  std::uint32_t generation = 0;
+  std::vector<Task> tasks;
+  std::shared_ptr<const std::string> current;
+  std::shared_ptr<const std::string> delta;
+  std::shared_ptr<const std::string> full;
+};
+
+// Hands the latest TreeSnapshot from one builder thread to reader threads
+// without locks. Publish() swaps the snapshot in with an atomic exchange, and
+// a reader announces the global epoch in its slot before it loads the
+// pointer. A replaced snapshot is retired with the epoch of its replacement
+// and freed once no reader is pinned at that epoch or an older one, so
+// readers never wait for the builder, nor the builder for readers, and a
+// reader only ever sees a complete snapshot.
+class SnapshotPublisher {
+ public:
+  static constexpr std::size_t kMaxReaders = 64;
+
+  // Pins the snapshot current at construction until destruction.
+  class ReadGuard {
+   public:
+    ReadGuard(SnapshotPublisher *publisher, std::size_t slot)
+        : slot_(&publisher->slots_[slot].epoch) {
+      slot_->store(publisher->epoch_.load());
+      snapshot_ = publisher->current_.load();
+    }
+    ~ReadGuard() { slot_->store(0, std::memory_order_release); }
+
+    ReadGuard(const ReadGuard &) = delete;
+    ReadGuard &operator=(const ReadGuard &) = delete;
+
+    // The snapshot, nullptr before the first one is published.
+    const TreeSnapshot *Get() const { return snapshot_; }
+
+   private:
+    std::atomic<std::uint64_t> *slot_;
+    const TreeSnapshot *snapshot_;
+  };
+
+  SnapshotPublisher() = default;
+  ~SnapshotPublisher() {
+    delete current_.load();
+    for (const Retired &retired : retired_) {
+      delete retired.snapshot;
+    }
+  }
+
+  SnapshotPublisher(const SnapshotPublisher &) = delete;
+  SnapshotPublisher &operator=(const SnapshotPublisher &) = delete;
+
+  // Returns the slot of a new reader thread, which it passes to every
+  // ReadGuard it takes.
+  std::size_t AddReader() {
+    std::size_t slot = num_readers_.fetch_add(1);
+    assert(slot < kMaxReaders);
+    return slot;
+  }
+
+  // Builder only: the last snapshot published, valid until the next
+  // Publish().
+  const TreeSnapshot *Latest() const {
+    return current_.load(std::memory_order_relaxed);
+  }
+
+  // Builder only: makes |snapshot| the current one and frees the retired
+  // snapshots no reader can hold anymore.
+  void Publish(std::unique_ptr<const TreeSnapshot> snapshot) {
+    const TreeSnapshot *old = current_.exchange(snapshot.release());
+    if (old != nullptr) {
+      // A reader that loaded |old| pinned at most this epoch.
+      retired_.push_back({epoch_.fetch_add(1), old});
+    }
+    std::uint64_t oldest = UINT64_MAX;
+    for (std::size_t i = 0; i < num_readers_.load(); i++) {
+      std::uint64_t epoch = slots_[i].epoch.load();
+      if (epoch != 0) {
+        oldest = std::min(oldest, epoch);
+      }
+    }
+    std::size_t kept = 0;
+    for (const Retired &retired : retired_) {
+      if (retired.epoch < oldest) {
+        delete retired.snapshot;
+      } else {
+        retired_[kept++] = retired;
+      }
+    }
+    retired_.resize(kept);
+  }
+
+ private:
+  struct alignas(64) Slot {
+    // The epoch the reader is pinned at, 0 while it holds nothing.
+    std::atomic<std::uint64_t> epoch{0};
+  };
+
+  struct Retired {
+    std::uint64_t epoch;
+    const TreeSnapshot *snapshot;
+  };
+
+  std::atomic<const TreeSnapshot *> current_{nullptr};
+  std::atomic<std::uint64_t> epoch_{1};
+  Slot slots_[kMaxReaders];
+  std::atomic<std::size_t> num_readers_{0};
+  std::vector<Retired> retired_;
+};
+
+// Builds the snapshots of a tree for --serve. Every Build() diffs the
+// processes against the previous snapshot once, and that delta is what
+// every client that is up to date receives, so the bytes sent follow the
+// churn rather than the size of the tree.
+class SnapshotBuilder {
+ public:
+  // |epoch| tells this server apart from an earlier run, whose generations
+  // a client may still be at.
+  explicit SnapshotBuilder(std::uint32_t epoch) : epoch_(epoch) {}
+
+  std::unique_ptr<const TreeSnapshot> Build(const PsTree &pstree,
+                                            const TreeSnapshot *previous) {
+    using Task = TreeSnapshot::Task;
+    std::unique_ptr<TreeSnapshot> snapshot(new TreeSnapshot);
+    std::vector<Task> &tasks = snapshot->tasks;
+    static const std::vector<Task> kNone;
+    const std::vector<Task> &old_tasks =
+        (previous != nullptr ? previous->tasks : kNone);
+    tasks.reserve(old_tasks.size());
+    for (NodeIndex index = 0; index < pstree.NumNodes(); index++) {
+      const TreeNode &node = *pstree.View(index);
+      if (node.alive && !node.IsThread() && node.pid > 0) {
+        tasks.push_back({node.pid, node.ppid, node.num_threads, node.name});
+      }
+    }
+    auto by_pid = [](const Task &lhs, const Task &rhs) {
+      return lhs.pid < rhs.pid;
+    };
+    if (!std::is_sorted(tasks.begin(), tasks.end(), by_pid)) {
+      std::sort(tasks.begin(), tasks.end(), by_pid);
+    }
+    // Both are in pid order, merge them.
+    std::vector<Task> changed;
+    std::vector<std::int32_t> removed;
+    std::size_t i = 0;
+    for (const Task &task : tasks) {
+      for (; i < old_tasks.size() && old_tasks[i].pid < task.pid; i++) {
+        removed.push_back(old_tasks[i].pid);
+      }
+      if (i < old_tasks.size() && old_tasks[i].pid == task.pid) {
+        const Task &old = old_tasks[i++];
+        if (old.ppid == task.ppid && old.threads == task.threads &&
+            old.name == task.name) {
+          continue;
+        }
+      }
+      changed.push_back(task);
+    }
+    for (; i < old_tasks.size(); i++) {
+      removed.push_back(old_tasks[i].pid);
+    }
+    snapshot->generation = ++generation_;
+    snapshot->delta = Encode(0, generation_ - 1, changed, removed);
+    snapshot->current = Encode(0, generation_, std::vector<Task>(),
+                               std::vector<std::int32_t>());
+    snapshot->full =
+        Encode(kDeltaFull, 0, tasks, std::vector<std::int32_t>());
+    return snapshot;
+  }
+
+ private:
+  std::shared_ptr<const std::string> Encode(
+      std::uint16_t flags, std::uint32_t base,
+      const std::vector<TreeSnapshot::Task> &tasks,
+      const std::vector<std::int32_t> &removed) const {
+    std::vector<DeltaTask> records;
+    records.reserve(tasks.size());
+    // Names repeat a lot, each is sent once per message.
+    std::unordered_map<NamePool::Id, std::uint32_t> offsets;
+    std::string strings;
+    for (const TreeSnapshot::Task &task : tasks) {
+      std::string_view name = NamePool::Get().View(task.name);
+      auto it = offsets.emplace(task.name,
+                                static_cast<std::uint32_t>(strings.size()));
+      if (it.second) {
+        strings.append(name);
+      }
+      records.push_back({static_cast<std::int32_t>(task.pid),
+                         static_cast<std::int32_t>(task.ppid),
+                         static_cast<std::int32_t>(task.threads),
+                         it.first->second,
+                         static_cast<std::uint32_t>(name.size())});
+    }
+    strings.resize((strings.size() + 3) & ~std::size_t(3), '\0');
+    DeltaHeader header;
+    memcpy(header.magic, kDeltaMagic, sizeof(header.magic));
+    header.version = kDeltaVersion;
+    header.flags = flags;
+    header.epoch = epoch_;
+    header.base = base;
+    header.generation = generation_;
+    header.num_tasks = static_cast<std::uint32_t>(records.size());
+    header.num_removed = static_cast<std::uint32_t>(removed.size());
+    header.strings_size = static_cast<std::uint32_t>(strings.size());
+    auto message = std::make_shared<std::string>();
+    message->reserve(sizeof(header) + records.size() * sizeof(DeltaTask) +
+                     removed.size() * sizeof(std::int32_t) + strings.size());
+    message->append(reinterpret_cast<const char *>(&header), sizeof(header));
+    message->append(reinterpret_cast<const char *>(records.data()),
+                    records.size() * sizeof(DeltaTask));
+    message->append(reinterpret_cast<const char *>(removed.data()),
+                    removed.size() * sizeof(std::int32_t));
+    message->append(strings);
+    return message;
+  }
+
+  std::uint32_t epoch_;
+  std::uint32_t generation_ = 0;
+};
+
+// Answers the clients of a listening socket from the snapshots of a
+// SnapshotPublisher, as one of its readers, on a single epoll loop.
+class SnapshotServer {
+ public:
+  SnapshotServer(SnapshotPublisher *publisher, std::uint32_t epoch)
+      : publisher_(publisher),
+        reader_(publisher->AddReader()),
+        epoll_fd_(epoll_create1(EPOLL_CLOEXEC)),
+        epoch_(epoch) {}
+
+  bool Listen(const std::string &address, std::string *error) {
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    if (!ResolveAddress(address, true, &addr, &addr_len, error)) {
+      return false;
+    }
+    listen_fd_.Reset(socket(addr.ss_family,
+                            SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    int one = 1;
+    if (listen_fd_.Get() < 0 ||
+        setsockopt(listen_fd_.Get(), SOL_SOCKET, SO_REUSEADDR, &one,
+                   sizeof(one)) < 0 ||
+        bind(listen_fd_.Get(), reinterpret_cast<struct sockaddr *>(&addr),
+             addr_len) < 0 ||
+        listen(listen_fd_.Get(), SOMAXCONN) < 0) {
+      *error = strerror(errno);
+      return false;
+    }
+    struct epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.fd = listen_fd_.Get();
+    return epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_ADD, listen_fd_.Get(),
+                     &event) == 0;
+  }
+
+  // Answers clients, forever.
+  void Serve() {
+    struct epoll_event events[64];
+    for (;;) {
+      int n = epoll_wait(epoll_fd_.Get(), events, 64, -1);
+      PSTREE_COUNT(kSyscalls, 1);
+      for (int i = 0; i < n; i++) {
+        int fd = events[i].data.fd;
+        if (fd == listen_fd_.Get()) {
+          Accept();
+        } else if (!Step(fd)) {
+          // Closing the fd drops it from the epoll set.
+          close(fd);
+          PSTREE_COUNT(kSyscalls, 1);
+          connections_.erase(fd);
+        }
+      }
+    }
+  }
+
+ private:
+  struct Connection {
+    std::string request;
+    std::shared_ptr<const std::string> response;
+    std::size_t sent = 0;
+  };
+
+  // Picks the response to |request| from the current snapshot, which is
+  // only pinned for as long as that takes.
+  std::shared_ptr<const std::string> Respond(const DeltaRequest &request) {
+    SnapshotPublisher::ReadGuard guard(publisher_, reader_);
+    const TreeSnapshot *snapshot = guard.Get();
+    if (snapshot == nullptr) {
+      return nullptr;
+    }
+    if (request.epoch == epoch_ && request.generation == snapshot->generation) {
+      return snapshot->current;
+    }
+    if (request.epoch == epoch_ &&
+        request.generation + 1 == snapshot->generation) {
+      return snapshot->delta;
+    }
+    return snapshot->full;
+  }
+
+  void Accept() {
+    for (;;) {
+      int fd = accept4(listen_fd_.Get(), nullptr, nullptr,
+                       SOCK_NONBLOCK | SOCK_CLOEXEC);
+      PSTREE_COUNT(kSyscalls, 1);
+      if (fd < 0) {
+        return;
+      }
+      int one = 1;
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      struct epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.fd = fd;
+      epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_ADD, fd, &event);
+      connections_[fd];
+    }
+  }
+
+  // Reads requests and writes responses on |fd| until it would block. Returns
+  // false once the connection is done with.
+  bool Step(int fd) {
+    Connection &connection = connections_[fd];
+    for (;;) {
+      if (connection.response) {
+        const std::string &response = *connection.response;
+        ssize_t n = send(fd, response.data() + connection.sent,
+                         response.size() - connection.sent, MSG_NOSIGNAL);
+        PSTREE_COUNT(kSyscalls, 1);
+        if (n < 0) {
+          return errno == EAGAIN && Wait(fd, EPOLLOUT);
+        }
+        connection.sent += n;
+        if (connection.sent < response.size()) {
+          continue;
+        }
+        connection.response.reset();
+        connection.sent = 0;
+        if (!Wait(fd, EPOLLIN)) {
+          return false;
+        }
+      }
+      if (connection.request.size() >= sizeof(DeltaRequest)) {
+        DeltaRequest request;
+        memcpy(&request, connection.request.data(), sizeof(request));
+        connection.request.erase(0, sizeof(request));
+        if (memcmp(request.magic, kDeltaMagic, sizeof(request.magic)) != 0) {
+          return false;
+        }
+        connection.response = Respond(request);
+        continue;
+      }
+      char buf[256];
+      ssize_t n = recv(fd, buf, sizeof(buf), 0);
+      PSTREE_COUNT(kSyscalls, 1);
+      if (n <= 0) {
+        return n < 0 && errno == EAGAIN;
+      }
+      connection.request.append(buf, n);
+    }
+  }
+
+  // Waits for |events| on |fd| instead of what it waited for.
+  bool Wait(int fd, std::uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.fd = fd;
+    return epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_MOD, fd, &event) == 0;
+  }
+
+  SnapshotPublisher *publisher_;
+  std::size_t reader_;
+  ScopedFd epoll_fd_;
+  ScopedFd listen_fd_;
+  std::uint32_t epoch_;
+  std::unordered_map<int, Connection> connections_;
+};
+
+// Pulls the snapshots of many --serve hosts at once over non-blocking
+// connections that are kept open from one pull to the next, and keeps a tree
+// per host whose root, the pid 0 node, is named after the host. Applying a
+// delta only touches the processes it names.
+class ForestClient {
+ public:
+  ForestClient() : epoll_fd_(epoll_create1(EPOLL_CLOEXEC)) {}
+
+  bool AddHost(const std::string &address, std::string *error) {
+    std::unique_ptr<Host> host(new Host);
+    host->name = address;
+    host->id = hosts_.size();
+    if (!ResolveAddress(address, false, &host->addr, &host->addr_len, error)) {
+      return false;
+    }
+    host->tree = NewTree(address);
+    hosts_.push_back(std::move(host));
+    return true;
+  }
+
+  // How the trees are drawn: threads as counts or hidden, as remote threads
+  // only travel as counts. The depth of |limits| counts from the host nodes.
+  void SetDisplay(ThreadMode thread_mode, bool fold_subtrees,
+                  SortOrder order, RenderLimits limits) {
+    thread_mode_ = thread_mode;
+    fold_subtrees_ = fold_subtrees;
+    order_ = order;
+    limits_ = limits;
+    for (std::unique_ptr<Host> &host : hosts_) {
+      host->tree->SetThreadMode(thread_mode_);
+      host->tree->SetFoldSubtrees(fold_subtrees_);
+      host->tree->SetRenderLimits(limits_);
+    }
+  }
+
+  // Sends every host a request and applies the answers that arrive within
+  // |timeout|. A host that fails or is late keeps its last tree.
+  void Gather(std::chrono::milliseconds timeout) {
+    auto deadline = std::chrono::steady_clock::now() + timeout;
+    std::size_t pending = 0;
+    for (std::unique_ptr<Host> &host : hosts_) {
+      if (Start(host.get())) {
+        pending++;
+      }
+    }
+    std::vector<struct epoll_event> events(
+        std::max<std::size_t>(std::min<std::size_t>(hosts_.size(), 1024), 1));
+    while (pending > 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (now >= deadline) {
+        break;
+      }
+      int wait = static_cast<int>(
+          std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now)
+              .count() + 1);
+      int n = epoll_wait(epoll_fd_.Get(), events.data(),
+                         static_cast<int>(events.size()), wait);
+      PSTREE_COUNT(kSyscalls, 1);
+      for (int i = 0; i < n; i++) {
+        Host *host = hosts_[events[i].data.u64].get();
+        if (host->state == State::kIdle) {
+          continue;
+        }
+        if (!Step(host)) {
+          // A connection kept from the last pull may have been closed by
+          // the server meanwhile, reconnect once before giving up.
+          if (!host->reused || !host->response.empty() || !Connect(host)) {
+            Fail(host, strerror(host->error));
+          }
+        }
+        if (host->state == State::kIdle) {
+          pending--;
+        }
+      }
+    }
+    for (std::unique_ptr<Host> &host : hosts_) {
+      if (host->state != State::kIdle) {
+        Fail(host.get(), "timed out");
+      }
+    }
+  }
+
+  // Draws the tree of every host, in the order they were added.
+  void Render(bool show_pids, OutputBuffer *out) const {
+    for (std::size_t i = 0; i < hosts_.size(); i++) {
+      if (i > 0) {
+        out->Put('\n');
+      }
+      hosts_[i]->tree->RenderTree(show_pids, out);
+    }
+  }
+
+  // Writes one JSON line or binary snapshot per host.
+  void Export(OutputFormat output) const {
+    for (const std::unique_ptr<Host> &host : hosts_) {
+      ExportTree(*host->tree, output);
+    }
+  }
+
+ private:
+  enum class State { kIdle, kConnecting, kSending, kReceiving };
+
+  struct Host {
+    std::string name;
+    // Index in hosts_, the epoll data of its connection.
+    std::size_t id = 0;
+    struct sockaddr_storage addr;
+    socklen_t addr_len = 0;
+    ScopedFd fd;
+    State state = State::kIdle;
+    // Whether the connection served an earlier pull.
+    bool reused = false;
+    int error = 0;
+    // A failure is reported once until the host answers again.
+    bool reported = false;
+    DeltaRequest request;
+    std::size_t sent = 0;
+    std::string response;
+    // The snapshot the tree is at, 0 for none.
+    std::uint32_t epoch = 0;
+    std::uint32_t generation = 0;
+    std::unique_ptr<PsTree> tree;
+  };
+
+  std::unique_ptr<PsTree> NewTree(const std::string &name) const {
+    std::unique_ptr<PsTree> tree(new PsTree(-1, name));
+    tree->SetRootPid(0);
+    tree->SetThreadMode(thread_mode_);
+    tree->SetFoldSubtrees(fold_subtrees_);
+    tree->SetRenderLimits(limits_);
+    tree->AddTask(name, 0, 0, 0, 1);
+    tree->LinkChildren();
+    return tree;
+  }
+
+  // Queues the request of |host|, connecting first if needed.
+  bool Start(Host *host) {
+    memcpy(host->request.magic, kDeltaMagic, sizeof(host->request.magic));
+    host->request.epoch = host->epoch;
+    host->request.generation = host->generation;
+    host->sent = 0;
+    host->response.clear();
+    host->error = 0;
+    if (host->fd.Get() < 0) {
+      return Connect(host);
+    }
+    host->reused = true;
+    host->state = State::kSending;
+    return Watch(host, EPOLL_CTL_ADD, EPOLLOUT);
+  }
+
+  bool Connect(Host *host) {
+    host->fd.Reset(socket(host->addr.ss_family,
+                          SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0));
+    PSTREE_COUNT(kSyscalls, 2);
+    host->reused = false;
+    host->sent = 0;
+    if (host->fd.Get() < 0) {
+      Fail(host, strerror(errno));
+      return false;
+    }
+    int one = 1;
+    setsockopt(host->fd.Get(), IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(host->fd.Get(),
+                reinterpret_cast<struct sockaddr *>(&host->addr),
+                host->addr_len) < 0 &&
+        errno != EINPROGRESS) {
+      Fail(host, strerror(errno));
+      return false;
+    }
+    host->state = State::kConnecting;
+    return Watch(host, EPOLL_CTL_ADD, EPOLLOUT);
+  }
+
+  bool Watch(Host *host, int op, std::uint32_t events) {
+    struct epoll_event event = {};
+    event.events = events;
+    event.data.u64 = host->id;
+    if (epoll_ctl(epoll_fd_.Get(), op, host->fd.Get(), &event) < 0) {
+      Fail(host, strerror(errno));
+      return false;
+    }
+    return true;
+  }
+
+  // Moves |host| along until it would block or its response is applied.
+  // Returns false with |error| set when the connection failed.
+  bool Step(Host *host) {
+    int fd = host->fd.Get();
+    if (host->state == State::kConnecting) {
+      socklen_t len = sizeof(host->error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &host->error, &len) < 0 ||
+          host->error != 0) {
+        return false;
+      }
+      host->state = State::kSending;
+    }
+    if (host->state == State::kSending) {
+      const char *request = reinterpret_cast<const char *>(&host->request);
+      while (host->sent < sizeof(host->request)) {
+        ssize_t n = send(fd, request + host->sent,
+                         sizeof(host->request) - host->sent, MSG_NOSIGNAL);
+        PSTREE_COUNT(kSyscalls, 1);
+        if (n < 0) {
+          host->error = errno;
+          return errno == EAGAIN;
+        }
+        host->sent += n;
+      }
+      struct epoll_event event = {};
+      event.events = EPOLLIN;
+      event.data.u64 = host->id;
+      if (epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_MOD, fd, &event) < 0) {
+        host->error = errno;
+        return false;
+      }
+      host->state = State::kReceiving;
+    }
+    for (;;) {
+      std::size_t size = host->response.size();
+      std::size_t want = sizeof(DeltaHeader);
+      if (size >= want && !ResponseSize(host->response, &want)) {
+        host->error = EPROTO;
+        return false;
+      }
+      if (size == want) {
+        break;
+      }
+      host->response.resize(want);
+      ssize_t n = recv(fd, &host->response[size], want - size, 0);
+      PSTREE_COUNT(kSyscalls, 1);
+      host->response.resize(n > 0 ? size + n : size);
+      if (n <= 0) {
+        host->error = (n == 0 ? ECONNRESET : errno);
+        return n < 0 && errno == EAGAIN;
+      }
+    }
+    if (!Apply(host)) {
+      host->error = EPROTO;
+      return false;
+    }
+    // Keep the connection for the next pull.
+    epoll_ctl(epoll_fd_.Get(), EPOLL_CTL_DEL, fd, nullptr);
+    host->state = State::kIdle;
+    host->reported = false;
+    return true;
   }
 
-  ~TreeNode() {
-    for (auto node : child_nodes) {
-      assert(node != nullptr);
-      delete node;
+  // Sets |size| to that of the response whose header starts |response|.
+  static bool ResponseSize(const std::string &response, std::size_t *size) {
+    DeltaHeader header;
+    memcpy(&header, response.data(), sizeof(header));
+    if (memcmp(header.magic, kDeltaMagic, sizeof(header.magic)) != 0 ||
+        header.version != kDeltaVersion || header.num_tasks > kMaxDeltaTasks ||
+        header.num_removed > kMaxDeltaTasks ||
+        header.strings_size > kMaxDeltaStrings) {
+      return false;
     }
+    *size = sizeof(header) + header.num_tasks * sizeof(DeltaTask) +
+            header.num_removed * sizeof(std::int32_t) + header.strings_size;
+    return true;
   }
 
-  bool InsertChild(TreeNode* node) {
-    if (node == nullptr) {
+  // Applies the response of |host| to its tree.
+  bool Apply(Host *host) {
+    const char *data = host->response.data();
+    DeltaHeader header;
+    memcpy(&header, data, sizeof(header));
+    bool full = (header.flags & kDeltaFull) != 0;
+    if (!full && (header.epoch != host->epoch ||
+                  header.base != host->generation)) {
       return false;
     }
-    child_nodes.push_back(node);
+    const char *tasks = data + sizeof(header);
+    const char *removed = tasks + header.num_tasks * sizeof(DeltaTask);
+    const char *strings = removed + header.num_removed * sizeof(std::int32_t);
+    for (std::uint32_t i = 0; i < header.num_tasks; i++) {
+      DeltaTask task;
+      memcpy(&task, tasks + i * sizeof(task), sizeof(task));
+      if (task.pid <= 0 || task.name_offset > header.strings_size ||
+          task.name_size > header.strings_size - task.name_offset) {
+        return false;
+      }
+    }
+    host->epoch = header.epoch;
+    host->generation = header.generation;
+    if (!full && header.num_tasks == 0 && header.num_removed == 0) {
+      return true;
+    }
+    if (full) {
+      host->tree = NewTree(host->name);
+    }
+    PsTree &tree = *host->tree;
+    for (std::uint32_t i = 0; i < header.num_removed; i++) {
+      std::int32_t pid;
+      memcpy(&pid, removed + i * sizeof(pid), sizeof(pid));
+      if (pid > 0) {
+        tree.RemoveTask(pid, pid);
+      }
+    }
+    for (std::uint32_t i = 0; i < header.num_tasks; i++) {
+      DeltaTask task;
+      memcpy(&task, tasks + i * sizeof(task), sizeof(task));
+      std::string_view name(strings + task.name_offset, task.name_size);
+      NodeView node = tree.FindTask(task.pid);
+      if (!node) {
+        tree.AddTask(name, task.pid, task.pid, task.ppid, task.num_threads);
+        continue;
+      }
+      if (node->Name() != name) {
+        tree.RenameTask(task.pid, name);
+      }
+      tree.SetTaskThreads(task.pid, task.num_threads);
+    }
+    tree.MaybeCompact();
+    // Now that every process is in, link the ones that came with the delta,
+    // which may have listed a child before its parent. Init and whatever has
+    // no parent in the tree hang from the host.
+    NodeIndex top = tree.FindTask(0).Index();
+    for (std::uint32_t i = 0; i < header.num_tasks; i++) {
+      DeltaTask task;
+      memcpy(&task, tasks + i * sizeof(task), sizeof(task));
+      NodeView node = tree.FindTask(task.pid);
+      if (node->IsRoot() || !tree.FindTask(task.ppid)) {
+        tree.InsertChild(top, node.Index());
+      } else {
+        tree.ReparentTask(task.pid, task.ppid);
+      }
+    }
+    tree.LinkChildren();
+    std::vector<NodeIndex> orphans = tree.TakeOrphans();
+    for (NodeIndex index : orphans) {
+      tree.InsertChild(top, index);
+    }
+    if (!orphans.empty()) {
+      tree.LinkChildren();
+    }
+    tree.SortTree(order_);
     return true;
   }
 
-  std::string Name() const { return name; }
+  void Fail(Host *host, const char *error) {
+    host->fd.Reset();
+    host->state = State::kIdle;
+    if (!host->reported) {
+      std::cerr << "Couldn't reach host: " << host->name << " (" << error
+                << ")" << std::endl;
+      host->reported = true;
+    }
+  }
 
-  bool IsRoot() const { return is_root; }
+  ScopedFd epoll_fd_;
+  std::vector<std::unique_ptr<Host>> hosts_;
+  ThreadMode thread_mode_ = ThreadMode::kCompact;
+  bool fold_subtrees_ = false;
+  RenderLimits limits_;
+  SortOrder order_ = SortOrder::kName;
+};
 
-  bool IsThread() const { return is_thread; }
+// How long a pull waits for the hosts, a slower one is drawn as it last was.
+constexpr std::chrono::milliseconds kGatherTimeout(1000);
 
-  bool HasThreads() const { return has_threads; }
+// --serve: a builder thread brings the tree up to date like --watch does and
+// publishes a snapshot every watch_interval, while this thread answers the
+// clients from whichever snapshot is current.
+void ServeSnapshots(const PstreeOptions &options, int proc_fd,
+                    PsTree *pstree) {
+  std::uint32_t epoch =
+      (static_cast<std::uint32_t>(
+           std::chrono::system_clock::now().time_since_epoch().count()) ^
+       static_cast<std::uint32_t>(getpid())) | 1;
+  SnapshotPublisher publisher;
+  SnapshotServer server(&publisher, epoch);
+  std::string error;
+  if (!server.Listen(options.serve_address, &error)) {
+    std::cerr << "Unable to serve on " << options.serve_address << ": "
+              << error << std::endl;
+    return;
+  }
+  SnapshotBuilder builder(epoch);
+  publisher.Publish(builder.Build(*pstree, nullptr));
+  std::thread updater([&] {
+    auto interval = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::duration<double>(options.watch_interval));
+    auto next = std::chrono::steady_clock::now();
+    std::vector<os_int> pids;
+    for (;;) {
+      if (options.stats) {
+        PrintStats();
+      }
+      next += interval;
+      std::this_thread::sleep_until(next);
+      pids.clear();
+      ReadProcs(proc_fd, -1, &pids);
+      pstree->UpdateTree(pids);
+      publisher.Publish(builder.Build(*pstree, publisher.Latest()));
+    }
+  });
+  server.Serve();
+  updater.join();
+}
 
-  std::string DebugString(bool show_pids) {
-    std::stringstream debug;
-    if (is_thread) {
-      debug << "{" << name << "}";
+// Draws the trees of the --hosts, pulled once or every watch_interval.
+void GatherForest(const PstreeOptions &options) {
+  ForestClient client;
+  for (const std::string &host : options.hosts) {
+    std::string error;
+    if (!client.AddHost(host, &error)) {
+      std::cerr << "Unknown host: " << host << " (" << error << ")"
+                << std::endl;
+      return;
+    }
+  }
+  // Remote threads only come as counts.
+  client.SetDisplay(options.thread_mode == ThreadMode::kHide
+                        ? ThreadMode::kHide
+                        : ThreadMode::kCompact,
+                    options.fold_subtrees,
+                    options.numeric_sort ? SortOrder::kPid : SortOrder::kName,
+                    options.render_limits);
+  FramePainter painter(STDOUT_FILENO, isatty(STDOUT_FILENO));
+  std::string frame;
+  for (;;) {
+    client.Gather(kGatherTimeout);
+    if (options.output != OutputFormat::kText) {
+      client.Export(options.output);
+    } else if (options.watch_interval <= 0) {
+      std::cout << std::endl << std::endl;
+      OutputBuffer out(STDOUT_FILENO);
+      client.Render(options.show_pids, &out);
     } else {
-      debug << name;
+      frame.clear();
+      {
+        OutputBuffer out(&frame);
+        client.Render(options.show_pids, &out);
+      }
+      painter.Paint(frame);
     }
-    if (show_pids) {
-      debug << "(" << pid << ")";
+    if (options.stats) {
+      PrintStats();
     }
-    return debug.str();
+    if (options.watch_interval <= 0) {
+      return;
+    }
+    std::this_thread::sleep_for(
+        std::chrono::duration<double>(options.watch_interval));
   }
+}
+
+// Shape of a synthetic procfs: |tasks| tasks in processes of |threads| tasks
+// each, every process having up to |fanout| children and the tree at most
+// |depth| levels.
+struct FixtureShape {
+  std::size_t tasks = 1000;
+  std::size_t threads = 4;
+  std::size_t fanout = 8;
+  std::size_t depth = 6;
 };
 
-class PsTree {
- public:
-  PsTree() = default;
+// Writes |content| to the new file |dir_fd|/|name|.
+bool WriteFixtureFile(int dir_fd, const char *name, const std::string &content) {
+  ScopedFd fd(openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+                     0644));
+  return fd.Get() >= 0 &&
+         write(fd.Get(), content.data(), content.size()) ==
+             static_cast<ssize_t>(content.size());
+}
 
-  ~PsTree() {
-    if (root_ != nullptr) {
-      delete root_;
-    }
+// Writes the status, stat and cmdline files of one task into |dir_fd|, in the
+// format of procfs even where this tool does not look.
+bool WriteFixtureTask(int dir_fd, const std::string &name, os_int pid,
+                      os_int tgid, os_int ppid, std::size_t threads) {
+  std::string status;
+  status += "Name:\t" + name + "\n";
+  status += "Umask:\t0022\nState:\tS (sleeping)\n";
+  status += "Tgid:\t" + std::to_string(tgid) + "\n";
+  status += "Ngid:\t0\n";
+  status += "Pid:\t" + std::to_string(pid) + "\n";
+  status += "PPid:\t" + std::to_string(ppid) + "\n";
+  status += "TracerPid:\t0\nUid:\t0\t0\t0\t0\nGid:\t0\t0\t0\t0\n";
+  status += "FDSize:\t64\nGroups:\t\n";
+  status += "NStgid:\t" + std::to_string(tgid) + "\n";
+  status += "NSpid:\t" + std::to_string(pid) + "\n";
+  status += "NSpgid:\t" + std::to_string(tgid) + "\n";
+  status += "NSsid:\t" + std::to_string(tgid) + "\n";
+  status += "VmPeak:\t   16892 kB\nVmSize:\t   16892 kB\nVmLck:\t       0 kB\n";
+  status += "VmRSS:\t    5432 kB\n";
+  status += "Threads:\t" + std::to_string(threads) + "\n";
+  status += "SigQ:\t0/63398\nSigPnd:\t0000000000000000\n";
+  status += "SigBlk:\t0000000000000000\nSigIgn:\t0000000000001000\n";
+  status += "CapInh:\t0000000000000000\nCapEff:\t000001ffffffffff\n";
+  status += "Seccomp:\t0\nCpus_allowed_list:\t0-7\n";
+  status += "voluntary_ctxt_switches:\t42\n";
+  status += "nonvoluntary_ctxt_switches:\t3\n";
+  std::string stat = std::to_string(pid) + " (" + name + ") S " +
+                     std::to_string(ppid) + " " + std::to_string(tgid) + " " +
+                     std::to_string(tgid) +
+                     " 0 -1 4194560 1031 0 0 0 12 3 0 0 20 0 " +
+                     std::to_string(threads) +
+                     " 0 1638 16891904 1358 18446744073709551615 1 1 0 0 0 "
+                     "0 0 4096 0 0 0 0 17 3 0 0 0 0 0 0 0 0 0 0 0 0 0\n";
+  std::string cmdline;
+  if (name == "sshd" || name == "postgres") {
+    // Titled like setproctitle() does: argv[0] rewritten, what was left of
+    // the argument area padded with NULs.
+    cmdline = name == "sshd" ? "sshd: user" + std::to_string(tgid) + " [priv]"
+                             : "postgres: checkpointer   ";
+    cmdline.append(16, '\0');
+  } else {
+    cmdline = name + '\0' + "--worker=" + std::to_string(tgid) + '\0';
   }
+  return WriteFixtureFile(dir_fd, "status", status) &&
+         WriteFixtureFile(dir_fd, "stat", stat) &&
+         WriteFixtureFile(dir_fd, "cmdline", cmdline);
+}
 
-  TreeNode *CreateTreeNode(std::string &name, os_int pid, os_int tgid,
-                           os_int ppid, os_int threads) {
-    TreeNode *node = new TreeNode(name, pid, tgid, ppid, threads);
-    if (node->IsRoot()) {
-      root_ = node;
-    }
-    all_tree_nodes_.push_back(node);
-    return node;
+// Generates a procfs shaped directory under |root|: /<pid>/{status,stat,
+// cmdline} and /<pid>/task/<tid>/{status,stat,cmdline,children} for every
+// process, pid 1 at the top.
+bool WriteProcFixture(const std::string &root, const FixtureShape &shape) {
+  static const char *const kNames[] = {"nginx",  "php-fpm", "postgres",
+                                       "bash",   "sshd",    "java",
+                                       "python3", "sleep"};
+  mkdir(root.c_str(), 0755);
+  ScopedFd root_fd(open(root.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (root_fd.Get() < 0) {
+    return false;
   }
-
-  TreeNode* RootNode() const { return root_; }
-
-  TreeNode *CreateTreeNode(const std::string &status_file,
-                           const std::string &proc_name) {
-    std::ifstream proc_status(status_file);
-    if (!proc_status.is_open()) {
-      std::cout << "Couldn't open file: " << status_file << std::endl;
-      return nullptr;
+  std::size_t threads = std::max<std::size_t>(shape.threads, 1);
+  std::size_t num_procs = std::max<std::size_t>(shape.tasks / threads, 1);
+  std::size_t fanout = std::max<std::size_t>(shape.fanout, 1);
+  // Processes that may still get children, in the order they were created.
+  std::vector<os_int> parents;
+  std::vector<std::size_t> depth(num_procs + 1, 0);
+  // The children file of every process, all children are its leader's.
+  std::vector<std::string> children(num_procs + 1);
+  os_int next_tid = static_cast<os_int>(num_procs) + 1;
+  for (std::size_t k = 0; k < num_procs; k++) {
+    os_int pid = static_cast<os_int>(k) + 1;
+    os_int ppid = 0;
+    if (k > 0) {
+      ppid = parents[((k - 1) / fanout) % parents.size()];
+      depth[pid] = depth[ppid] + 1;
+      children[ppid] += std::to_string(pid) + " ";
     }
-    std::string name;
-    os_int pid{-1};
-    os_int tgid{-1};
-    os_int ppid{-1};
-    os_int threads{-1};
-
-    std::string line;
-    while(std::getline(proc_status, line, '\n')) {
-      std::string::size_type comma_pos = line.find(":");
-      if (comma_pos == std::string::npos) {
-        continue;
-      }
-      std::string attr_str = line.substr(0, comma_pos);
-      std::string::size_type value_pos = comma_pos + 1;
-      while (value_pos < line.size() && isspace(line.at(value_pos))) {
-        value_pos++;
-      }
-      if (value_pos == line.size()) {
-        continue;
-      }
-      std::string value_str = line.substr(value_pos);
-      if (attr_str == "Name") {
-        name = value_str;
-        continue;
-      }
-      if (attr_str == "Tgid") {
-        tgid = static_cast<os_int>(std::stoi(value_str));
-        continue;
-      }
-      if (attr_str == "Pid") {
-        pid = static_cast<os_int>(std::stoi(value_str));
-        continue;
-      }
-      if (attr_str == "PPid") {
-        ppid = static_cast<os_int>(std::stoi(value_str));
-        continue;
-      }
-      if (attr_str == "Threads") {
-        threads = static_cast<os_int>(std::stoi(value_str));
-      }
-      if (!name.empty() && pid > 0 && tgid > 0 && ppid > 0 && threads > 0) {
-        break;
-      }
+    if (depth[pid] + 1 < shape.depth) {
+      parents.push_back(pid);
     }
-    name = (proc_name.empty() ? name : proc_name);
-    return CreateTreeNode(name, pid, tgid, ppid, threads);
-  }
-
-  bool CreateTreeNodes(const std::vector<std::string> &proc_files) {
-    for (auto proc_file : proc_files) {
-      TreeNode *node = CreateTreeNode(proc_file, "");
-      if (node == nullptr) {
-        std::cout << "Unable to create TreeNode for: " << proc_file
-                  << std::endl;
+    if (parents.empty()) {
+      parents.push_back(pid);
+    }
+    const std::string name = (pid == 1 ? "init" : kNames[k % 8]);
+    char path[64];
+    mkdirat(root_fd.Get(), TaskPath(pid, "", path), 0755);
+    ScopedFd proc_fd(openat(root_fd.Get(), TaskPath(pid, "", path),
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    mkdirat(proc_fd.Get(), "task", 0755);
+    ScopedFd task_fd(openat(proc_fd.Get(), "task",
+                            O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+    if (task_fd.Get() < 0 ||
+        !WriteFixtureTask(proc_fd.Get(), name, pid, pid, ppid, threads)) {
+      return false;
+    }
+    for (std::size_t t = 0; t < threads; t++) {
+      os_int tid = (t == 0 ? pid : next_tid++);
+      mkdirat(task_fd.Get(), TaskPath(tid, "", path), 0755);
+      ScopedFd thread_fd(openat(task_fd.Get(), TaskPath(tid, "", path),
+                                O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+      if (thread_fd.Get() < 0 ||
+          !WriteFixtureTask(thread_fd.Get(), name, tid, pid, ppid, threads) ||
+          !WriteFixtureFile(thread_fd.Get(), "children", "")) {
         return false;
-      } else if (!node->IsThread() && node->HasThreads()) {
-        std::size_t file_pos = proc_file.rfind('/');
-        assert(file_pos != std::string::npos);
-        std::size_t dir_pos = proc_file.rfind('/', file_pos - 1);
-        assert(dir_pos != std::string::npos);
-        std::string proc_file_name =
-            proc_file.substr(dir_pos + 1, file_pos - dir_pos - 1);
-        // std::cout << "process proc file: " << proc_file_name << std::endl;
-        std::string proc_file_dir = proc_file.substr(0, file_pos);
-        std::vector<std::string> threads_file;
-        const std::string threads_dir = proc_file_dir + std::string("/task");
-        ReadProcs(threads_dir, "status", proc_file_name, &threads_file);
-        for (auto thread_file : threads_file) {
-          // std::cout << "process thread file: " << thread_file << std::endl;
-          TreeNode *thread_node = CreateTreeNode(thread_file, node->Name());
-          if (thread_node == nullptr) {
-            std::cout << "Unable to create TreeNode for: " << thread_file
-                      << std::endl;
-            return false;
-          }
-        }
       }
     }
-    // Create virtual kernal node.
-    std::string virtual_root("kernal");
-    CreateTreeNode(virtual_root, 0, 0, 0, 1);
-    return true;
   }
-
-  bool BuildTreeNodeMap() {
-    if (all_tree_nodes_.empty()) {
-      std::cout << "Empty tree node list." << std::endl;
+  for (std::size_t k = 0; k < num_procs; k++) {
+    os_int pid = static_cast<os_int>(k) + 1;
+    char path[64];
+    if (!WriteFixtureFile(root_fd.Get(), PsTree::ChildrenPath(pid, pid, path),
+                          children[pid])) {
       return false;
     }
-
-    for (TreeNode *node : all_tree_nodes_) {
-      assert(node != nullptr);
-      nodes_map_[node->pid] = node;
-    }
-    return true;
   }
+  // A day up, for the start times of the stat files.
+  return WriteFixtureFile(root_fd.Get(), "uptime", "86400.00 172800.00\n");
+}
 
-  void BuildTree(const std::vector<std::string> &proc_files) {
-    if (proc_files.empty()) {
-      std::cout << "Empty process files." << std::endl;
-      return;
+// Wall time of each phase of a run, in seconds.
+struct PhaseTimings {
+  double enumerate = 0;
+  double parse = 0;
+  double link = 0;
+  double sort = 0;
+  double render = 0;
+  // Tasks in the tree and bytes of output.
+  std::size_t tasks = 0;
+  std::size_t bytes = 0;
+};
+
+// Builds and renders the tree of |options.proc_root| phase by phase, best of
+// kBenchRuns runs each.
+constexpr int kBenchRuns = 3;
+
+bool BenchmarkPstree(const PstreeOptions &options, PhaseTimings *best) {
+  using Clock = std::chrono::steady_clock;
+  auto seconds = [](Clock::time_point from, Clock::time_point to) {
+    return std::chrono::duration<double>(to - from).count();
+  };
+  ScopedFd proc_fd(open(options.proc_root.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (proc_fd.Get() < 0) {
+    return false;
+  }
+  WorkStealingPool pool(options.num_jobs);
+  for (int run = 0; run < kBenchRuns; run++) {
+    PhaseTimings timings;
+    PsTree pstree(proc_fd.Get(), options.proc_root, options.format);
+    pstree.SetWorkerPool(&pool);
+    pstree.SetThreadMode(options.thread_mode);
+    pstree.SetFoldSubtrees(options.fold_subtrees);
+    pstree.SetRenderLimits(options.render_limits);
+    pstree.SetResources(options.resources);
+    std::string uring_error;
+    if (options.uring) {
+      pstree.UseUring(&uring_error);
     }
-    CreateTreeNodes(proc_files);
-    BuildTreeNodeMap();
-    for (TreeNode *node : all_tree_nodes_) {
-      if (node->IsRoot()) {
-        continue;
-      }
-      os_int parent_id = node->IsThread() ? node->tgid : node->ppid;
-      if (nodes_map_.find(parent_id) == nodes_map_.end()) {
-        std::cout << "Unable to find parent node for: " << node->name << "("
-                  << node->pid << ")" << std::endl;
-        return;
+    std::vector<os_int> pids;
+    Clock::time_point t0 = Clock::now();
+    ReadProcs(proc_fd.Get(), -1, &pids);
+    Clock::time_point t1 = Clock::now();
+    pstree.CreateTreeNodes(pids);
+    Clock::time_point t2 = Clock::now();
+    pstree.LinkTree();
+    Clock::time_point t3 = Clock::now();
+    pstree.SortTree(options.numeric_sort ? SortOrder::kPid
+                                         : SortOrder::kName);
+    Clock::time_point t4 = Clock::now();
+    std::string frame;
+    {
+      OutputBuffer out(&frame);
+      if (options.output == OutputFormat::kJson) {
+        pstree.WriteJson(&out);
+      } else if (options.output == OutputFormat::kBinary) {
+        pstree.WriteBinary(&out);
+      } else {
+        pstree.RenderTree(options.show_pids, &out);
       }
-      TreeNode *parent_node = nodes_map_[parent_id];
-      parent_node->InsertChild(node);
     }
+    Clock::time_point t5 = Clock::now();
+    timings.enumerate = seconds(t0, t1);
+    timings.parse = seconds(t1, t2);
+    timings.link = seconds(t2, t3);
+    timings.sort = seconds(t3, t4);
+    timings.render = seconds(t4, t5);
+    timings.tasks = pstree.NumTasks();
+    timings.bytes = frame.size();
+    if (run == 0) {
+      *best = timings;
+      continue;
+    }
+    best->enumerate = std::min(best->enumerate, timings.enumerate);
+    best->parse = std::min(best->parse, timings.parse);
+    best->link = std::min(best->link, timings.link);
+    best->sort = std::min(best->sort, timings.sort);
+    best->render = std::min(best->render, timings.render);
   }
+  return true;
+}
 
-  void SortTree() {
-    // sort child nodes by their pids.
-    // NOTE:
-    // Because we read files from the /proc directory in order, the process tree
-    // already follows the node pid ascending relationship when it is created,
-    // so we don't need to sort it.
+void PrintTimingsHeader() {
+  for (const char *column : {"tasks", "enum ms", "parse ms", "link ms",
+                             "sort ms", "render ms", "out KiB"}) {
+    std::cout << std::setw(11) << column;
   }
+  std::cout << std::endl;
+}
 
-  // pre-order traverse of pstree.
-  void PrintTree(bool show_pids) const {
-    std::cout << std::endl << std::endl;
-    std::stringstream ss;
-    std::vector<int> branches;
-    std::vector<bool> enable_branches;
-    PrintTree(root_, 0, branches, enable_branches, show_pids, ss);
-    std::cout << ss.str();
+void PrintTimings(const PhaseTimings &timings) {
+  std::cout << std::fixed << std::setprecision(2) << std::setw(11)
+            << timings.tasks;
+  for (double phase : {timings.enumerate, timings.parse, timings.link,
+                       timings.sort, timings.render}) {
+    std::cout << std::setw(11) << phase * 1e3;
   }
+  std::cout << std::setw(11) << timings.bytes / 1024 << std::endl;
+}
 
-  void PrintTree(TreeNode *node, int start_pos, std::vector<int> &branches,
-                 std::vector<bool> &enable_branches, bool show_pids,
-                 std::stringstream &ss) const {
-    if (node == nullptr) {
-      return;
+// --bench-kernels: parses the status file of every process of
+// |options.proc_root| with each kStatusKernels entry the cpu supports, checks
+// that it agrees with the scalar kernel and prints the best of kBenchRuns
+// timings.
+bool BenchmarkStatusKernels(const PstreeOptions &options) {
+  using Clock = std::chrono::steady_clock;
+  ScopedFd proc_fd(open(options.proc_root.c_str(),
+                        O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (proc_fd.Get() < 0) {
+    return false;
+  }
+  std::vector<os_int> pids;
+  ReadProcs(proc_fd.Get(), -1, &pids);
+  std::vector<std::string> files;
+  std::size_t total_bytes = 0;
+  for (os_int pid : pids) {
+    char path[64];
+    ScopedFd fd(openat(proc_fd.Get(), TaskPath(pid, "status", path),
+                       O_RDONLY | O_CLOEXEC));
+    if (fd.Get() < 0) {
+      continue;
     }
-
-    std::string node_str = node->DebugString(show_pids);
-    ss << node_str;
-    int branch_pos = start_pos + node_str.size() + 3;
-    branches.push_back(branch_pos);
-    enable_branches.push_back(true);
-    for (std::size_t cid = 0; cid < node->child_nodes.size(); cid++) {
-      if (cid == 0) {
-        if (node->child_nodes.size() > 1) {
-          ss << "--+--";
-        } else {
-          ss << "-----";
+    std::string file(kProcFileBufSize, '\0');
+    ssize_t n = read(fd.Get(), &file[0], file.size());
+    if (n <= 0) {
+      continue;
+    }
+    file.resize(n);
+    total_bytes += n;
+    files.push_back(std::move(file));
+  }
+  if (files.empty()) {
+    return false;
+  }
+  // Enough rounds for a few MiB per timing.
+  const std::size_t rounds = std::max<std::size_t>(1, (8 << 20) / total_bytes);
+  auto same = [](const ProcStatus &a, const ProcStatus &b) {
+    return a.name == b.name && a.pid == b.pid && a.tgid == b.tgid &&
+           a.ppid == b.ppid && a.threads == b.threads && a.uid == b.uid &&
+           a.rss_kb == b.rss_kb;
+  };
+  // The fields a run with |options| parses.
+  const unsigned fields =
+      (options.uid_filter >= 0 ? kFieldUid : 0u) |
+      (options.resources ? kFieldResources : 0u) |
+      (options.group != GroupMode::kNone ? kFieldNamespace : 0u);
+  for (const char *column : {"kernel", "ns/file", "MiB/s", "mismatches"}) {
+    std::cout << std::setw(11) << column;
+  }
+  std::cout << std::endl;
+  for (const StatusKernel &kernel : kStatusKernels) {
+    if (!kernel.supported()) {
+      continue;
+    }
+    const ProcParser parse = kernel.parse[fields];
+    std::size_t mismatches = 0;
+    for (const std::string &file : files) {
+      ProcStatus expected;
+      ProcStatus actual;
+      kStatusKernels[0].parse[fields](file.data(), file.size(), -1,
+                                      options.uid_filter, &expected);
+      parse(file.data(), file.size(), -1, options.uid_filter, &actual);
+      mismatches += !same(expected, actual);
+    }
+    double best = 0;
+    os_int checksum = 0;
+    for (int run = 0; run < kBenchRuns; run++) {
+      Clock::time_point start = Clock::now();
+      for (std::size_t round = 0; round < rounds; round++) {
+        for (const std::string &file : files) {
+          ProcStatus status;
+          parse(file.data(), file.size(), -1, options.uid_filter, &status);
+          checksum += status.pid + status.threads;
         }
       }
-      if (cid + 1 == node->child_nodes.size()) {
-        enable_branches.back() = false;
-      }
-      PrintTree(node->child_nodes[cid], branch_pos + 2, branches,
-                enable_branches, show_pids, ss);
-
-      if (cid + 1 < node->child_nodes.size()) {
-        ss << "\n";
-        if (!branches.empty()) {
-          int last_br_pos = 0;
-          for (int br_ind = 0; br_ind < branches.size(); br_ind++) {
-            if (enable_branches[br_ind]) {
-              ss << std::string(branches[br_ind] - last_br_pos - 1, ' ') << "|";
-            } else {
-              ss << std::string(branches[br_ind] - last_br_pos, ' ');
-            }
-            last_br_pos = branches[br_ind];
-          }
-          ss << "--";
-        }
+      double elapsed =
+          std::chrono::duration<double>(Clock::now() - start).count();
+      if (run == 0 || elapsed < best) {
+        best = elapsed;
       }
     }
-    branches.pop_back();
-    enable_branches.pop_back();
+    // A volatile store keeps the parses from being optimized out.
+    [[maybe_unused]] volatile os_int sink = checksum;
+    std::cout << std::setw(11) << kernel.name << std::fixed
+              << std::setprecision(1) << std::setw(11)
+              << best * 1e9 / (rounds * files.size()) << std::setw(11)
+              << rounds * total_bytes / best / (1 << 20) << std::setw(11)
+              << mismatches
+              << (&kernel == &BestStatusKernel() ? "  (selected)" : "")
+              << std::endl;
   }
+  return true;
+}
 
-private:
-  TreeNode *root_ = nullptr;
-  std::vector<TreeNode *> all_tree_nodes_;
-  std::unordered_map<os_int, TreeNode *> nodes_map_;
-};
-
-void PrintVersion() { std::cout << "my_pstree v1.0." << std::endl; }
-
-bool IsProcDir(std::string& dir_name) {
-  std::size_t pos{};
-  try {
-    const int i{std::stoi(dir_name, &pos)};
-  } catch(std::invalid_argument const& ex) {
-    // std::cout << "dir_name: " << dir_name << " is not a process directory.\n";
-    // std::cout << "std::invalid_argument::what(): " << ex.what() << std::endl;
-  } catch (std::out_of_range const& ex) {
-    const long long ll{std::stoi(dir_name, &pos)};
-    // std::cout << "std::out_of_range::what(): " << ex.what() << std::endl;
+// --bench-sweep: generates (or reuses) a fixture of each size under |dir|
+// and prints the phase timings of every one.
+void RunBenchmarkSweep(const PstreeOptions &options, const std::string &dir,
+                       const FixtureShape &shape) {
+  static const std::size_t kSizes[] = {1000, 10000, 100000, 1000000};
+  mkdir(dir.c_str(), 0755);
+  PrintTimingsHeader();
+  for (std::size_t tasks : kSizes) {
+    FixtureShape fixture = shape;
+    fixture.tasks = tasks;
+    PstreeOptions run = options;
+    run.proc_root = dir + "/" + std::to_string(tasks);
+    struct stat st;
+    if (stat(run.proc_root.c_str(), &st) != 0 &&
+        !WriteProcFixture(run.proc_root, fixture)) {
+      std::cerr << "Unable to write fixture: " << run.proc_root << std::endl;
+      return;
+    }
+    PhaseTimings timings;
+    if (!BenchmarkPstree(run, &timings)) {
+      std::cerr << "Unable to benchmark: " << run.proc_root << std::endl;
+      return;
+    }
+    PrintTimings(timings);
   }
-
-  return pos == dir_name.length();
 }
 
-void ReadProcs(const std::string &dir_fpath, const std::string &file_name,
-               const std::string &skip, std::vector<std::string> *files) {
-  DIR *dirp = opendir(dir_fpath.c_str());
-  struct dirent *dp;
-  while ((dp = readdir(dirp)) != nullptr) {
-    std::string dir_name(dp->d_name);
-    if (!IsProcDir(dir_name)) {
-      continue;
+// |kColumns| is Columns(options.show_pids, options.resources,
+// options.args_size > 0), fixed by main
+// so that the text renderer is instantiated for exactly that column set.
+// Returns false if there was no tree to draw.
+template <unsigned kColumns>
+bool RunPstree(const PstreeOptions &options) {
+  if (options.benchmark) {
+    PhaseTimings timings;
+    if (!BenchmarkPstree(options, &timings)) {
+      std::cerr << "Unable to benchmark: " << options.proc_root << std::endl;
+      return false;
     }
-    if (dir_name == skip) {
-      continue;
+    PrintTimingsHeader();
+    PrintTimings(timings);
+    return true;
+  }
+  if (!options.hosts.empty()) {
+    GatherForest(options);
+    return true;
+  }
+  const std::string &dir_fpath = options.proc_root;
+  // Opened once, every later lookup is relative to it.
+  ScopedFd proc_fd(open(dir_fpath.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+  if (proc_fd.Get() < 0) {
+    std::cerr << "Couldn't open directory: " << dir_fpath << std::endl;
+    return false;
+  }
+  std::vector<os_int> pids;
+  ProcConnector connector;
+  if (options.proc_events && !connector.Open()) {
+    std::cerr << "Unable to subscribe to process events (needs CAP_NET_ADMIN)"
+              << ", rescanning /proc instead." << std::endl;
+  }
+  // A cache only stands for a whole tree drawn once.
+  bool use_cache = !options.cache_path.empty() && !options.resources &&
+                   options.root_pid <= 0 && !options.bpf_tasks &&
+                   options.watch_interval <= 0 &&
+                   options.serve_address.empty();
+  std::vector<std::uint64_t> inodes;
+  // Read process directory to get the pid of every process.
+  ReadProcs(proc_fd.Get(), -1, &pids, use_cache ? &inodes : nullptr);
+  WorkStealingPool pool(options.num_jobs);
+  PsTree pstree(proc_fd.Get(), dir_fpath, options.format);
+  pstree.SetWorkerPool(&pool);
+  pstree.SetThreadMode(options.thread_mode);
+  pstree.SetFoldSubtrees(options.fold_subtrees);
+  pstree.SetRenderLimits(options.render_limits);
+  if (options.root_pid > 0) {
+    pstree.SetRootPid(options.root_pid);
+  }
+  pstree.SetUidFilter(options.uid_filter);
+  pstree.SetResources(options.resources);
+  pstree.SetArgs(options.args_size);
+  pstree.SetGroupMode(options.group);
+  pstree.SetStartTimes(use_cache);
+  std::string uring_error;
+  if (options.uring && !pstree.UseUring(&uring_error)) {
+    std::cerr << "io_uring unavailable (" << uring_error
+              << "), reading /proc synchronously." << std::endl;
+  }
+  std::vector<TaskRecord> tasks;
+  std::string bpf_error;
+  if (use_cache && pstree.LoadCache(options.cache_path, pids, inodes)) {
+    // Only the changes were read.
+  } else if (options.root_pid > 0 && !options.bpf_tasks &&
+             pstree.BuildSubtree()) {
+    // Only the subtree was read.
+  } else if (options.children_walk && !options.bpf_tasks &&
+             pstree.BuildTreeTopDown()) {
+    // Linked while walking.
+  } else if (options.bpf_tasks &&
+             BpfTaskIterator::ReadTasks(&tasks, &bpf_error)) {
+    pstree.BuildTree(tasks, pids);
+  } else {
+    if (options.bpf_tasks) {
+      std::cerr << "BPF task iterator unavailable (" << bpf_error
+                << "), reading /proc instead." << std::endl;
     }
-    std::string file_fpath;
-    if (dir_fpath.back() == '/') {
-      file_fpath = dir_fpath + dir_name + std::string("/") + file_name;
+    pstree.BuildTree(pids);
+  }
+  pstree.CompleteFilteredTasks();
+  if (options.root_pid > 0 && !pstree.HasRoot()) {
+    std::cerr << "No such process: " << options.root_pid << std::endl;
+    return false;
+  }
+  if (!options.serve_address.empty()) {
+    // Clients sort for themselves.
+    ServeSnapshots(options, proc_fd.Get(), &pstree);
+    return true;
+  }
+  pstree.GroupTasks();
+  pstree.SortTree(options.numeric_sort ? SortOrder::kPid
+                                       : SortOrder::kName);
+  pstree.FetchArgs();
+  if (options.watch_interval <= 0) {
+    if (options.output != OutputFormat::kText) {
+      ExportTree(pstree, options.output);
     } else {
-      file_fpath = dir_fpath + std::string("/") + dir_name + std::string("/") +
-          file_name;
+      pstree.PrintTree<kColumns>();
+    }
+    if (use_cache) {
+      pstree.SaveCache(options.cache_path, pids, inodes);
+    }
+    if (options.stats) {
+      PrintStats();
     }
-    files->push_back(file_fpath);
+    return true;
   }
-  closedir(dirp);
-}
 
-void RunPstree(bool show_pids, bool numeric_sort = false) {
-  std::string dir_fpath("/proc");
-  std::string status_file("status");
-  std::string skip("");
-  std::vector<std::string> files;
-  // Read process directory to get corresponding status file.
-  ReadProcs(dir_fpath, status_file, skip, &files);
-  // Read hidden(ls -al won't show) thread directory to get corresponding status
-  // file,
-  PsTree pstree;
-  pstree.BuildTree(files);
-  if (numeric_sort) {
-    pstree.SortTree();
+  if (connector.Fd() >= 0) {
+    WatchProcEvents(options, proc_fd.Get(), &pstree, &connector);
+    return true;
+  }
+
+  // Keep the tree and update it in place from one snapshot to the next.
+  FramePainter painter(STDOUT_FILENO, isatty(STDOUT_FILENO));
+  std::string frame;
+  for (;;) {
+    if (options.output != OutputFormat::kText) {
+      ExportTree(pstree, options.output);
+    } else {
+      frame.clear();
+      {
+        OutputBuffer out(&frame);
+        pstree.RenderTree<kColumns>(&out);
+      }
+      painter.Paint(frame);
+    }
+    if (options.stats) {
+      PrintStats();
+    }
+    std::this_thread::sleep_for(
+        std::chrono::duration<double>(options.watch_interval));
+    pids.clear();
+    ReadProcs(proc_fd.Get(), -1, &pids);
+    pstree.UpdateTree(pids);
+    pstree.GroupTasks();
+    pstree.SortTree(options.numeric_sort ? SortOrder::kPid
+                                         : SortOrder::kName);
+    pstree.FetchArgs();
   }
-  pstree.PrintTree(show_pids);
 }
 
 } // namespace m1
 } // namespace os
 
 
+#if PSTREE_STATS
+// Counts every allocation of the process for --stats. Out of line like
+// operator delete below, for the same reason.
+__attribute__((noinline)) void *operator new(std::size_t size) {
+  os::m1::CountStat(os::m1::StatCounter::kAllocations, 1);
+  if (void *p = std::malloc(size == 0 ? 1 : size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+// Out of line, or GCC flags the free() of memory from operator new that it
+// sees once inlined.
+__attribute__((noinline)) void operator delete(void *p) noexcept {
+  std::free(p);
+}
+
+__attribute__((noinline)) void operator delete(void *p, std::size_t) noexcept {
+  std::free(p);
+}
+#endif
+
 // Hits: Using g++ m1_pstree.cc to build file, then ./a.out -p to execute it.
 int main(int argc, char *argv[]) {
-  bool show_pids = false;
-  bool numeric_sort = false;
+  os::m1::PstreeOptions options;
   bool version = false;
+  bool hide_threads = false;
+  bool no_compaction = false;
+  bool long_lines = false;
+  bool show_args = false;
+  std::size_t args_max = os::m1::kDefaultArgsSize;
+  os::m1::FixtureShape fixture;
+  std::string fixture_dir;
+  std::string sweep_dir;
+  bool bench_kernels = false;
   for (int i = 1; i < argc; i++) {
     assert(argv[i]);
     // currently, multiple option combinations are not handled, eg. -np.
     if (strcmp(argv[i], "-p") == 0) {
-      show_pids = true;
+      options.show_pids = true;
       continue;
     }
     if (strcmp(argv[i], "-n") == 0) {
-      numeric_sort = true;
+      options.numeric_sort = true;
       continue;
     }
     if (strcmp(argv[i], "-V") == 0) {
       version = true;
       continue;
     }
+    if (strcmp(argv[i], "-c") == 0) {
+      no_compaction = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-T") == 0) {
+      hide_threads = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-l") == 0) {
+      long_lines = true;
+      continue;
+    }
+    if (strcmp(argv[i], "-a") == 0) {
+      show_args = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--args-max") == 0) {
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--args-max requires a number of bytes." << std::endl;
+        return 1;
+      }
+      args_max = strtoul(argv[++i], nullptr, 10);
+      if (args_max == 0) {
+        std::cerr << "Invalid --args-max: " << argv[i] << std::endl;
+        return 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--max-depth") == 0) {
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--max-depth requires a number of levels." << std::endl;
+        return 1;
+      }
+      options.render_limits.max_depth = strtoul(argv[++i], nullptr, 10);
+      continue;
+    }
+    if (strncmp(argv[i], "--format=", 9) == 0) {
+      const char *format = argv[i] + 9;
+      if (strcmp(format, "text") == 0) {
+        options.output = os::m1::OutputFormat::kText;
+      } else if (strcmp(format, "json") == 0) {
+        options.output = os::m1::OutputFormat::kJson;
+      } else if (strcmp(format, "binary") == 0) {
+        options.output = os::m1::OutputFormat::kBinary;
+      } else {
+        std::cerr << "Unknown --format: " << format << std::endl;
+        return 1;
+      }
+      continue;
+    }
+    std::string *dir = strcmp(argv[i], "--proc-root") == 0 ? &options.proc_root
+                       : strcmp(argv[i], "--gen-fixture") == 0 ? &fixture_dir
+                       : strcmp(argv[i], "--bench-sweep") == 0 ? &sweep_dir
+                                                               : nullptr;
+    if (dir != nullptr) {
+      if (argv[i + 1] == nullptr) {
+        std::cerr << argv[i] << " requires a directory." << std::endl;
+        return 1;
+      }
+      *dir = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "-u") == 0) {
+      // -u user or -u uid.
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "-u requires a user." << std::endl;
+        return 1;
+      }
+      const char *user = argv[++i];
+      char *end;
+      unsigned long uid = strtoul(user, &end, 10);
+      if (*end == '\0' && end != user) {
+        options.uid_filter = static_cast<os::m1::os_int>(uid);
+      } else if (const struct passwd *pw = getpwnam(user)) {
+        options.uid_filter = pw->pw_uid;
+      } else {
+        std::cerr << "Unknown user: " << user << std::endl;
+        return 1;
+      }
+      // The stat format has no uid.
+      options.format = os::m1::ProcFormat::kStatus;
+      continue;
+    }
+    if (isdigit(static_cast<unsigned char>(argv[i][0]))) {
+      // A pid to draw the subtree of.
+      options.root_pid = strtol(argv[i], nullptr, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--stats") == 0) {
+      options.stats = true;
+      os::m1::EnableStats();
+      continue;
+    }
+    if (strcmp(argv[i], "--bench-kernels") == 0) {
+      bench_kernels = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--bench") == 0) {
+      options.benchmark = true;
+      continue;
+    }
+    if (strncmp(argv[i], "--fixture-", 10) == 0) {
+      // --fixture-{tasks,threads,fanout,depth} N shape a generated fixture.
+      const char *field = argv[i] + 10;
+      std::size_t *value = strcmp(field, "tasks") == 0     ? &fixture.tasks
+                           : strcmp(field, "threads") == 0 ? &fixture.threads
+                           : strcmp(field, "fanout") == 0  ? &fixture.fanout
+                           : strcmp(field, "depth") == 0   ? &fixture.depth
+                                                           : nullptr;
+      if (value == nullptr || argv[i + 1] == nullptr) {
+        std::cerr << "Invalid fixture option: " << argv[i] << std::endl;
+        return 1;
+      }
+      *value = strtoul(argv[++i], nullptr, 10);
+      continue;
+    }
+    if (strcmp(argv[i], "--stat") == 0) {
+      options.format = os::m1::ProcFormat::kStat;
+      continue;
+    }
+    if (strcmp(argv[i], "--group") == 0) {
+      // --group pidns or --group cgroup.
+      const char *mode = argv[i + 1];
+      if (mode != nullptr && strcmp(mode, "pidns") == 0) {
+        options.group = os::m1::GroupMode::kPidNamespace;
+      } else if (mode != nullptr && strcmp(mode, "cgroup") == 0) {
+        options.group = os::m1::GroupMode::kCgroup;
+      } else {
+        std::cerr << "--group requires pidns or cgroup." << std::endl;
+        return 1;
+      }
+      i++;
+      // The stat format has no namespaces.
+      options.format = os::m1::ProcFormat::kStatus;
+      continue;
+    }
+    if (strcmp(argv[i], "--resources") == 0) {
+      options.resources = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--cache") == 0) {
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--cache requires a file." << std::endl;
+        return 1;
+      }
+      options.cache_path = argv[++i];
+      continue;
+    }
+    if (strcmp(argv[i], "--children") == 0) {
+      options.children_walk = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--uring") == 0) {
+      options.uring = true;
+      continue;
+    }
+    if (strcmp(argv[i], "--bpf") == 0) {
+      options.bpf_tasks = true;
+      continue;
+    }
+    if (strncmp(argv[i], "-j", 2) == 0) {
+      // -j N or -jN, 0 means one worker per online cpu.
+      const char *jobs = argv[i][2] != '\0' ? argv[i] + 2 : argv[++i];
+      if (jobs == nullptr) {
+        std::cerr << "-j requires a number of jobs." << std::endl;
+        return 1;
+      }
+      options.num_jobs = strtoul(jobs, nullptr, 10);
+      if (options.num_jobs == 0) {
+        options.num_jobs = std::thread::hardware_concurrency();
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--events") == 0) {
+      options.proc_events = true;
+      if (options.watch_interval <= 0) {
+        options.watch_interval = 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--serve") == 0) {
+      // --serve [host:]port
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--serve requires an address." << std::endl;
+        return 1;
+      }
+      options.serve_address = argv[++i];
+      if (options.watch_interval <= 0) {
+        options.watch_interval = 1;
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--hosts") == 0) {
+      // --hosts host:port[,host:port...], may be repeated.
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--hosts requires a list of host:port." << std::endl;
+        return 1;
+      }
+      std::stringstream list(argv[++i]);
+      std::string host;
+      while (std::getline(list, host, ',')) {
+        if (!host.empty()) {
+          options.hosts.push_back(host);
+        }
+      }
+      continue;
+    }
+    if (strcmp(argv[i], "--watch") == 0) {
+      if (argv[i + 1] == nullptr) {
+        std::cerr << "--watch requires an interval in seconds." << std::endl;
+        return 1;
+      }
+      options.watch_interval = strtod(argv[++i], nullptr);
+      if (options.watch_interval <= 0) {
+        std::cerr << "Invalid --watch interval: " << argv[i] << std::endl;
+        return 1;
+      }
+      continue;
+    }
+  }
+  // Threads and identical subtrees are told apart by their pids only, so
+  // without -p they are counted instead of listed, unless -c asks for all.
+  bool compact = !options.show_pids && !no_compaction;
+  if (hide_threads) {
+    options.thread_mode = os::m1::ThreadMode::kHide;
+  } else if (compact) {
+    options.thread_mode = os::m1::ThreadMode::kCompact;
+  }
+  if (show_args) {
+    options.args_size = args_max;
+  }
+  // Identical subtrees still differ in their resources and arguments.
+  options.fold_subtrees =
+      compact && !options.resources && options.args_size == 0;
+  if ((options.resources || !options.cache_path.empty()) &&
+      options.uid_filter < 0 && options.group == os::m1::GroupMode::kNone) {
+    // CPU and start times are only in stat, the resident set is in both.
+    options.format = os::m1::ProcFormat::kStat;
+  }
+  if (!options.serve_address.empty()) {
+    // Only counts are sent, clients draw or hide them.
+    options.thread_mode = os::m1::ThreadMode::kCompact;
+  }
+  // Machine readable output has stdout to itself, and every level of the
+  // tree.
+  bool text = (options.output == os::m1::OutputFormat::kText);
+  if (!text) {
+    options.render_limits.max_depth = SIZE_MAX;
+  }
+  if (text && !long_lines) {
+    options.render_limits.width = os::m1::OutputWidth(STDOUT_FILENO);
+  }
+  if (text) {
+    std::cout << std::boolalpha << "show_pids: " << options.show_pids
+              << std::endl;
+    std::cout << std::boolalpha << "numeric_sort: " << options.numeric_sort
+              << std::endl;
+    std::cout << std::boolalpha << "version: " << version << std::endl;
   }
-  std::cout << std::boolalpha << "show_pids: " << show_pids << std::endl;
-  std::cout << std::boolalpha << "numeric_sort: " << numeric_sort << std::endl;
-  std::cout << std::boolalpha << "version: " << version << std::endl;
   if (version) {
     os::m1::PrintVersion();
   }
-  if (show_pids || numeric_sort) {
-    os::m1::RunPstree(show_pids, numeric_sort);
+  if (!fixture_dir.empty()) {
+    if (!os::m1::WriteProcFixture(fixture_dir, fixture)) {
+      std::cerr << "Unable to write fixture: " << fixture_dir << std::endl;
+      return 1;
+    }
+    return 0;
+  }
+  if (!sweep_dir.empty()) {
+    os::m1::RunBenchmarkSweep(options, sweep_dir, fixture);
+    return 0;
+  }
+  if (bench_kernels) {
+    if (!os::m1::BenchmarkStatusKernels(options)) {
+      std::cerr << "Unable to benchmark: " << options.proc_root << std::endl;
+    }
+    return 0;
+  }
+  // Every option shapes the tree, -V alone only asks for the version.
+  if (!version || argc > 2) {
+    bool ok = true;
+    os::m1::WithColumns(
+        os::m1::Columns(options.show_pids, options.resources,
+                        options.args_size > 0),
+        [&](auto columns) {
+          ok = os::m1::RunPstree<decltype(columns)::value>(options);
+        });
+    if (!ok) {
+      return 1;
+    }
   }
   assert(!argv[argc]);
   return 0;